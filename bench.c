@@ -0,0 +1,273 @@
+/* micro benchmarks for the C API of lua-sched.
+ *
+ * results are printed to stdout as JSON, so they can be saved and
+ * compared across releases or Lua versions, e.g.:
+ *
+ *   bench > 5.3.json
+ *
+ * give the names of benchmarks to run only them, bench.lua is the
+ * same thing for the Lua API. */
+#define LSC_IMPLEMENTATION
+#include "lsched.h"
+
+#include <lualib.h>
+#include <stdio.h>
+#include <time.h>
+
+static const char *waiter_code =
+    "local wait, s = require 'sched.task'.wait, ...\n"
+    "repeat local _, err = wait(s) until err\n";
+
+static lua_State *L;
+static lsc_State *S;
+static int nresults;
+
+static double elapsed_ns(clock_t start) {
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, long n, double value, const char *unit) {
+    printf("%s\n    { \"name\": \"%s\", \"n\": %ld, \"value\": %.3f,"
+           " \"unit\": \"%s\" }", nresults++ ? "," : "", name, n, value,
+           unit);
+    fflush(stdout);
+}
+
+static void push_code(const char *code) {
+    /* compiled function is cached in registry */
+    if (lua53_rawgetp(L, LUA_REGISTRYINDEX, code) == LUA_TFUNCTION)
+        return;
+    lua_pop(L, 1);
+    if (luaL_loadstring(L, code) != LUA_OK)
+        lua_error(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, code);
+}
+
+static const char *receiver_code =
+    "local wait, s = require 'sched.task'.wait, ...\n"
+    "repeat local v = wait(s) until v == nil\n";
+
+static lsc_Signal *new_tasks(const char *code, int n) {
+    /* n tasks wait on a new signal (left on stack) in a loop, until
+     * the signal is deleted */
+    lsc_Signal *s = lsc_newsignal(L, 0);
+    int i;
+    for (i = 0; i < n; ++i) {
+        push_code(code);
+        lua_pushvalue(L, -2);
+        lsc_spawn(L, 1);
+        lua_pop(L, 1);
+    }
+    lsc_once(S, L);
+    return s;
+}
+
+static lsc_Signal *new_waiters(int n) {
+    return new_tasks(waiter_code, n);
+}
+
+static void free_waiters(lsc_Signal *s) {
+    lsc_deletesignal(s, L);
+    lua_pop(L, 1);
+    lsc_loop(S, L);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+static void bench_wakeup(long n) {
+    lsc_Signal *s = new_waiters(1);
+    clock_t start = clock();
+    long i;
+    for (i = 0; i < n; ++i)
+        lsc_wakeup(lsc_next(s, NULL), L, 0);
+    report("lsc_wakeup", n, elapsed_ns(start) / n, "ns/op");
+    free_waiters(s);
+}
+
+static void bench_emit(long n) {
+    static const int fanouts[] = { 1, 100, 100000 };
+    size_t i;
+    for (i = 0; i < sizeof(fanouts)/sizeof(fanouts[0]); ++i) {
+        int fanout = fanouts[i];
+        long j, rounds = n / fanout > 0 ? n / fanout : 1;
+        lsc_Signal *s = new_waiters(fanout);
+        char name[64];
+        clock_t start = clock();
+        for (j = 0; j < rounds; ++j)
+            lsc_emit(s, L, 0);
+        sprintf(name, "lsc_emit/%d", fanout);
+        report(name, rounds * fanout, elapsed_ns(start) / (rounds * fanout),
+                "ns/task");
+        free_waiters(s);
+    }
+}
+
+static void bench_broadcast(long n) {
+    /* emit 5 values to 50000 waiters */
+    int i, fanout = 50000;
+    long j, rounds = n / fanout > 0 ? n / fanout : 1;
+    lsc_Signal *s = new_tasks(receiver_code, fanout);
+    clock_t start = clock();
+    for (j = 0; j < rounds; ++j) {
+        for (i = 0; i < 5; ++i)
+            lua_pushinteger(L, i);
+        lsc_emit(s, L, 5);
+    }
+    report("lsc_emit/50000 5 args", rounds * fanout,
+            elapsed_ns(start) / (rounds * fanout), "ns/task");
+    free_waiters(s);
+}
+
+static void bench_spawn(long n) {
+    clock_t start = clock();
+    long i, j;
+    for (i = 0; i < n; i += 100) {
+        for (j = 0; j < 100; ++j) {
+            push_code("");
+            lsc_spawn(L, 0);
+            lua_pop(L, 1);
+        }
+        lsc_loop(S, L);
+    }
+    report("lsc_spawn", n, elapsed_ns(start) / n, "ns/task");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+static void bench_once(long n) {
+    /* ready all waiters and run them in one tick */
+    int size = 100000;
+    long i, rounds = n / size > 0 ? n / size : 1;
+    lsc_Signal *s = new_waiters(size);
+    double total = 0;
+    for (i = 0; i < rounds; ++i) {
+        lsc_Task *t;
+        clock_t start;
+        while ((t = lsc_next(s, NULL)) != NULL)
+            lsc_ready(t, 0); /* it's removed from s */
+        start = clock();
+        lsc_once(S, L);
+        total += elapsed_ns(start);
+    }
+    report("lsc_once/100000", rounds * size, total / (rounds * size),
+            "ns/task");
+    free_waiters(s);
+}
+
+static void bench_ready(long n) {
+    /* move waiters to ready queue, one by one or at once */
+    static const int sizes[] = { 1000, 100000 };
+    size_t k;
+    for (k = 0; k < sizeof(sizes)/sizeof(sizes[0]); ++k) {
+        int size = sizes[k];
+        long i, rounds = n / size > 0 ? n / size : 1;
+        lsc_Signal *s = new_waiters(size);
+        double one = 0, all = 0;
+        char name[64];
+        for (i = 0; i < rounds; ++i) {
+            lsc_Task *t;
+            clock_t start = clock();
+            while ((t = lsc_next(s, NULL)) != NULL)
+                lsc_ready(t, 0);
+            one += elapsed_ns(start);
+            lsc_once(S, L);
+            start = clock();
+            lsc_readyall(s);
+            all += elapsed_ns(start);
+            lsc_once(S, L);
+        }
+        sprintf(name, "lsc_ready/%d", size);
+        report(name, rounds * size, one / (rounds * size), "ns/task");
+        sprintf(name, "lsc_readyall/%d", size);
+        report(name, rounds * size, all / (rounds * size), "ns/task");
+        free_waiters(s);
+    }
+}
+
+static void bench_idle(long n) {
+    lsc_Signal *s;
+    int base;
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    base = lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+    s = new_waiters((int)n);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    report("idle task", n, (double)(lua_gc(L, LUA_GCCOUNT, 0) * 1024
+                + lua_gc(L, LUA_GCCOUNTB, 0) - base) / n, "bytes/task");
+    free_waiters(s);
+}
+
+static void bench_collect(long n) {
+    clock_t start;
+    long i;
+    for (i = 0; i < n; ++i) {
+        push_code("error 'boom'");
+        lsc_spawn(L, 0);
+        lua_pop(L, 1);
+    }
+    lsc_once(S, L);
+    start = clock();
+    lsc_collect(L, S, NULL, NULL);
+    report("lsc_collect", n, elapsed_ns(start) / n, "ns/task");
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+static struct {
+    const char *name;
+    void (*f)(long n);
+    long n;
+} benchs[] = {
+    { "wakeup",  bench_wakeup,  1000000 },
+    { "emit",    bench_emit,    1000000 },
+    { "broadcast", bench_broadcast, 1000000 },
+    { "spawn",   bench_spawn,   100000 },
+    { "once",    bench_once,    1000000 },
+    { "ready",   bench_ready,   1000000 },
+    { "idle",    bench_idle,    100000 },
+    { "collect", bench_collect, 100000 },
+    { NULL, NULL, 0 }
+};
+
+static int run(lua_State *L) {
+    int i, j, argc = (int)lua_tointeger(L, 1);
+    char **argv = (char**)lua_touserdata(L, 2);
+    luaL_requiref(L, "sched.signal", luaopen_sched_signal, 0);
+    luaL_requiref(L, "sched.task", luaopen_sched_task, 0);
+    lua_pop(L, 2);
+    lsc_install(L);
+    S = lsc_state(L);
+    for (i = 0; benchs[i].name != NULL; ++i) {
+        int selected = argc <= 1;
+        for (j = 1; j < argc; ++j)
+            if (strcmp(argv[j], benchs[i].name) == 0)
+                selected = 1;
+        if (selected) benchs[i].f(benchs[i].n);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int res;
+    if ((L = luaL_newstate()) == NULL) {
+        fprintf(stderr, "not enough memory\n");
+        return 1;
+    }
+    luaL_openlibs(L);
+    printf("{\n  \"driver\": \"c\",\n  \"lua\": \"%s\",\n"
+           "  \"extraspace\": %s,\n  \"results\": [",
+#ifdef LSC_USE_EXTRASPACE
+           LUA_VERSION, "true");
+#else
+           LUA_VERSION, "false");
+#endif
+    lua_pushcfunction(L, run);
+    lua_pushinteger(L, argc);
+    lua_pushlightuserdata(L, argv);
+    if ((res = lua_pcall(L, 2, 0, 0)) != LUA_OK)
+        fprintf(stderr, "bench: %s\n", lua_tostring(L, -1));
+    printf("\n  ]\n}\n");
+    lua_close(L);
+    return res != LUA_OK;
+}
+
+/* cc: flags+='-s -O2' libs+='-llua53' output='bench.exe'
+ * cc: run='bench.exe' */
@@ -0,0 +1,411 @@
+local sched = require "sched"
+local task = require "sched.task"
+local signal = require "sched.signal"
+
+local benchs = {}
+local order = {}
+local results = {}
+
+-- with --json, results are printed as JSON, and others go to stderr
+local json = arg[1] == "--json"
+if json then table.remove(arg, 1) end
+local print = not json and print or function(...)
+   local t = table.pack(...)
+   for i = 1, t.n do t[i] = tostring(t[i]) end
+   io.stderr:write(table.concat(t, "\t"), "\n")
+end
+
+local function add_bench(name, f)
+   order[#order+1] = name
+   benchs[name] = f
+end
+
+local function report(name, n, value, unit)
+   results[#results+1] = { name = name, n = n, value = value, unit = unit }
+end
+
+local function timeit(name, n, f)
+   local start = os.clock()
+   f(n)
+   local elapsed = os.clock() - start
+   print(("%-20s %10d %10.3f ms %10.1f ns/op"):format(
+      name, n, elapsed * 1000, elapsed * 1e9 / n))
+   report(name, n, elapsed * 1e9 / n, "ns/op")
+end
+
+local function dump_json()
+   local function str(s)
+      return '"' .. s:gsub('[%c"\\]', function(c)
+         return ("\\u%04x"):format(c:byte())
+      end) .. '"'
+   end
+   io.write('{\n  "driver": "lua",\n  "lua": ', str(_VERSION),
+      ',\n  "results": [')
+   for i, r in ipairs(results) do
+      io.write(i > 1 and "," or "", ('\n    { "name": %s, "n": %d,'
+         .. ' "value": %.3f, "unit": %s }'):format(str(r.name), r.n,
+         r.value, str(r.unit)))
+   end
+   io.write("\n  ]\n}\n")
+end
+
+add_bench("current_bench", function()
+   local N = 1000000
+   task.new(function()
+      timeit("task.status()", N, function(n)
+         for i = 1, n do task.status() end
+      end)
+   end)
+   local s = signal.new()
+   task.new(function()
+      timeit("wait/emit", N, function(n)
+         for i = 1, n do task.wait(s) end
+      end)
+   end)
+   sched.once()
+   timeit("signal:index(1)", N, function(n)
+      for i = 1, n do s:index(1) end
+   end)
+   for i = 1, N do s:emit() end
+   assert(s:count() == 0)
+end)
+
+add_bench("emit_bench", function()
+   for _, fanout in ipairs { 1, 100, 100000 } do
+      local s = signal.new()
+      local rounds = math.max(1000000 // fanout, 1)
+      for i = 1, fanout do
+         task.new(function()
+            repeat local _, err = task.wait(s) until err
+         end)
+      end
+      sched.once()
+      timeit(("emit/%d"):format(fanout), rounds * fanout, function()
+         for i = 1, rounds do s:emit() end
+      end)
+      s:delete()
+      assert(sched.loop())
+   end
+   -- broadcast 5 values to 50000 waiters
+   local s, N = signal.new(), 50000
+   for i = 1, N do
+      task.new(function()
+         repeat local a = task.wait(s) until a == nil
+      end)
+   end
+   sched.once()
+   timeit("emit/50000 5 args", N * 20, function()
+      for i = 1, 20 do s:emit(1, 2, "three", 4, 5) end
+   end)
+   s:delete()
+   assert(sched.loop())
+end)
+
+add_bench("channel_bench", function()
+   local channel = require "sched.channel"
+   local N = 1000000
+   local function run(name, recv)
+      local ch = channel.new(64)
+      task.new(function()
+         for i = 1, N do ch:send(i) end
+         ch:close()
+      end)
+      task.new(function() recv(ch) end)
+      timeit(name, N, function() assert(sched.loop()) end)
+   end
+   run("channel recv", function(ch)
+      repeat local v = ch:recv() until v == nil
+   end)
+   run("channel recvmany(64)", function(ch)
+      repeat local v = ch:recvmany(64) until v == nil
+   end)
+   -- hand-off by signal, one wakeup per value
+   local s = signal.new()
+   task.new(function()
+      repeat local v = task.wait(s) until v == nil
+   end)
+   sched.once()
+   timeit("signal emit", N, function()
+      for i = 1, N do s:emit(i) end
+      s:emit()
+   end)
+end)
+
+add_bench("sync_bench", function()
+   local sync = require "sched.sync"
+   local T, K = 100, 1000
+   -- T tasks contend for a lock, holding it across a yield, and count
+   -- the times a task gets the lock again with others waitting
+   local function run(name, lock, unlock)
+      local last, barged = nil, 0
+      for i = 1, T do
+         task.new(function()
+            for j = 1, K do
+               lock()
+               if last == i then barged = barged + 1 end
+               last = i
+               sched.sleep(0)
+               unlock()
+            end
+         end)
+      end
+      timeit(name, T * K, function() assert(sched.loop()) end)
+      print(("  barged %d times"):format(barged))
+   end
+   local m = sync.mutex()
+   run("sync.mutex", function() m:lock() end, function() m:unlock() end)
+   -- the usual lock made of a signal and a flag
+   local s, locked = signal.new(), false
+   local function lua_lock()
+      while locked do task.wait(s) end
+      locked = true
+   end
+   local function lua_unlock()
+      locked = false
+      s:one()
+   end
+   run("signal lock", lua_lock, lua_unlock)
+   run("signal lock (ready)", lua_lock, function()
+      locked = false
+      s:ready() -- all waiters race at next tick
+   end)
+   local sem = sync.semaphore(10)
+   run("semaphore(10)", function() sem:acquire() end,
+      function() sem:release() end)
+   local N = 1000000
+   task.new(function()
+      timeit("uncontended mutex", N, function(n)
+         for i = 1, n do m:lock(); m:unlock() end
+      end)
+      timeit("uncontended lua lock", N, function(n)
+         for i = 1, n do lua_lock(); lua_unlock() end
+      end)
+   end)
+   assert(sched.loop())
+end)
+
+add_bench("keyed_bench", function()
+   -- N requests wait for replies, every reply wakes its caller
+   local N = 10000
+   local s = signal.new()
+   for i = 1, N do
+      task.new(function() task.wait(s, i) end)
+   end
+   sched.once()
+   timeit("reply by filter", N, function()
+      for i = 1, N do
+         s:filter(function(t, id)
+            if id == i then t:wakeup "reply" end
+         end)
+      end
+   end)
+   local k = signal.keyed()
+   for i = 1, N do
+      task.new(function() k:wait(i) end)
+   end
+   sched.once()
+   timeit("reply by keyed", N, function()
+      for i = 1, N do k:emit(i, "reply") end
+   end)
+end)
+
+add_bench("future_bench", function()
+   local future = require "sched.future"
+   local N = 100000
+   -- a task waits for N results, by one future per result, or by a
+   -- task joining all of them
+   local fs = {}
+   for i = 1, N do fs[i] = future.new() end
+   task.new(function() future.all(fs):await() end)
+   sched.once()
+   timeit("future.all", N, function()
+      for i = 1, N do fs[i]:resolve(i) end
+      assert(sched.loop())
+   end)
+   local ss, res = {}, {}
+   for i = 1, N do ss[i] = signal.new() end
+   task.new(function()
+      for i = 1, N do res[i] = task.wait(ss[i]) end
+   end)
+   sched.once()
+   timeit("join by signals", N, function()
+      for i = 1, N do ss[i]:emit(i) end
+      assert(sched.loop())
+   end)
+   timeit("future andthen", N, function()
+      local f = future.new()
+      local g = f
+      for i = 1, N do g = g:andthen(function(v) return v end) end
+      f:resolve(1)
+      assert(g:status() == "resolved")
+   end)
+end)
+
+add_bench("spawn_bench", function()
+   -- task.new is not pooled, see bench.c for the pooled `lsc_spawn`
+   local N = 100000
+   timeit("spawn", N, function(n)
+      for i = 1, n, 50 do
+         for j = 1, 50 do task.new(function() end) end
+         sched.loop()
+      end
+      collectgarbage()
+   end)
+end)
+
+add_bench("idle_bench", function()
+   local N = 100000
+   local s = signal.new()
+   local f = function() end
+   collectgarbage()
+   local base = collectgarbage "count"
+   for i = 1, N do task.new(f, i):wait(s) end
+   collectgarbage()
+   local used = collectgarbage "count" - base
+   print(("%-20s %10d %10.1f KB %10.1f B/task"):format(
+      "idle task.new(f, i)", N, used, used * 1024 / N))
+   report("idle task.new(f, i)", N, used * 1024 / N, "bytes/task")
+   timeit("start idle tasks", N, function()
+      s:emit()
+   end)
+end)
+
+add_bench("collect_bench", function()
+   local N = 100000
+   local f = function() error "boom" end
+   for i = 1, N do task.new(f) end
+   assert(sched.once() == nil)
+   timeit("collect errors", N, function()
+      assert(#sched.collect() > 0)
+   end)
+   collectgarbage()
+end)
+
+add_bench("priority_bench", function()
+   local function run(name, prio, quota)
+      local lat, done = {}, false
+      sched.quota(3, quota)
+      for i = 1, 2000 do
+         task.new(function()
+            while not done do
+               for j = 1, 100 do end
+               sched.sleep(0)
+            end
+         end):priority(3)
+      end
+      task.new(function()
+         for i = 1, 200 do
+            local start = os.clock()
+            sched.sleep(0)
+            lat[i] = os.clock() - start
+         end
+         done = true
+      end):priority(prio)
+      assert(sched.loop())
+      table.sort(lat)
+      print(("%-20s p50 %8.3f ms  p99 %8.3f ms"):format(name,
+         lat[#lat//2] * 1000, lat[math.ceil(#lat*0.99)] * 1000))
+   end
+   run("same priority", 3, 0)
+   run("high priority", 0, 0)
+   run("high + quota 100", 0, 100)
+   sched.quota(3, 0)
+end)
+
+add_bench("budget_bench", function()
+   local N = 50000
+   local function run(name, budget)
+      for i = 1, N do
+         task.new(function() for j = 1, 50 do end end)
+      end
+      local ticks, worst = 0, 0
+      repeat
+         local start = os.clock()
+         local more = sched.once(budget)
+         worst = math.max(worst, os.clock() - start)
+         ticks = ticks + 1
+      until not more
+      print(("%-20s %6d ticks, max gap between polls %8.3f ms"):format(
+         name, ticks, worst * 1000))
+   end
+   run("no budget")
+   run("budget 1000 tasks", { budget = 1000 })
+   run("budget 1 ms", { time = 0.001 })
+end)
+
+add_bench("spin_bench", function()
+   local ok, sio = pcall(require, "sched.io")
+   if not ok then return end
+   local N = 50
+   local path = os.tmpname()
+   os.remove(path)
+   assert(os.execute("mkfifo " .. path))
+   for _, spin in ipairs { 0, 0.00005, 0.001 } do
+      local f = assert(io.open(path, "r+"))
+      local fd = sio.fileno(f)
+      -- another process writes a byte every 5 ms
+      os.execute(("(for i in $(seq %d); do sleep 0.005; printf x; done) > %s &")
+         :format(N, path))
+      sched.spin(spin)
+      task.new(function()
+         for i = 1, N do
+            sio.wait(fd, "r")
+            f:read(1)
+         end
+         sio.close(fd)
+      end)
+      timeit(("spin %g s"):format(spin), N, function()
+         assert(sched.loop())
+      end)
+      f:close()
+   end
+   os.remove(path)
+   sched.spin(0)
+end)
+
+add_bench("cluster_bench", function()
+   local ok, cluster = pcall(require, "sched.cluster")
+   if not ok then return end
+   local K = 100000
+   -- every worker sends K messages to the next one in a ring
+   local code = [[
+      local cluster = require "sched.cluster"
+      local task = require "sched.task"
+      local id, n, K = ...
+      task.new(function()
+         local to = id % n + 1
+         for i = 1, K do cluster.send(to, i, "message") end
+      end)
+      task.new(function()
+         for i = 1, K do cluster.recv() end
+         cluster.send(0, id)
+      end)
+   ]]
+   for _, n in ipairs { 1, 2, 4, 8, 16 } do
+      local start = sched.now()
+      cluster.start(n, code, K)
+      task.new(function()
+         for i = 1, n do cluster.recv() end
+      end)
+      assert(sched.loop())
+      assert(cluster.join())
+      local elapsed = sched.now() - start
+      print(("%-20s %10d %10.3f ms %10.0f msg/s"):format(
+         ("cluster %d workers"):format(n), n * K, elapsed * 1000,
+         n * K / elapsed))
+   end
+end)
+
+if arg[1] then
+   if benchs[arg[1]] then
+      print(arg[1])
+      benchs[arg[1]]()
+   end
+else
+   for _,k in ipairs(order) do
+      print(k.."...")
+      benchs[k]()
+   end
+end
+
+if json then dump_json() end
@@ -1,3 +1,10 @@
+/* the implementation uses POSIX functions (e.g. clock_gettime), the
+ * feature-test macro must be defined before any system header */
+#if defined(LSC_IMPLEMENTATION) && !defined(_WIN32) \
+    && !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+# define _POSIX_C_SOURCE 200112L
+#endif
+
 #ifndef lsched_h
 #define lsched_h
 
@@ -27,9 +34,27 @@
 
 #define LSCLUA_API LSC_API
 
+#if defined(__linux__) && !defined(LSC_NO_EPOLL) && !defined(LSC_USE_EPOLL)
+# define LSC_USE_EPOLL
+#endif
+
+/* cluster and offload are opt-in, they need the epoll backend */
+#ifndef LSC_USE_EPOLL
+# undef LSC_USE_CLUSTER
+# undef LSC_USE_OFFLOAD
+#endif
+
 LSC_NS_BEGIN
 
 typedef struct lsc_State lsc_State;
+
+/* nanosecond counter of monotonic clock, for budgets and stats. it's
+ * 64 bits on all platforms, so it never wraps in practice. */
+#ifdef _MSC_VER
+typedef unsigned __int64 lsc_Clock;
+#else
+typedef unsigned long long lsc_Clock;
+#endif
 typedef struct lsc_Task lsc_Task;
 typedef struct lsc_Signal lsc_Signal;
 
@@ -73,7 +98,10 @@ typedef enum lsc_Status {
 /*
  * poll function for once/loop
  * with global state, the lua_State from once/loop called (can be NULL) and a uservalue.
- * return non-zero if the loop will continue, or 0 break the loop.
+ * return non-zero if the loop will continue, or 0 if the loop only
+ * continues when there are tasks ready or timers pending.
+ * NOTE that older versions inverted the result (0 kept the loop
+ * running), poll functions written for them must flip it.
  */
 typedef int lsc_Poll(lsc_State *s, lua_State *from, void *ud);
 
@@ -93,10 +121,25 @@ typedef int lsc_Collect(lsc_Task *t, lua_State *from, void *ud);
 LSCLUA_API int luaopen_sched(lua_State *L);
 LSCLUA_API int luaopen_sched_signal(lua_State *L);
 LSCLUA_API int luaopen_sched_task(lua_State *L);
+LSCLUA_API int luaopen_sched_channel(lua_State *L);
+LSCLUA_API int luaopen_sched_sync(lua_State *L);
+LSCLUA_API int luaopen_sched_future(lua_State *L);
+#ifdef LSC_USE_EPOLL
+LSCLUA_API int luaopen_sched_io(lua_State *L);
+#endif
+#ifdef LSC_USE_CLUSTER
+LSCLUA_API int luaopen_sched_cluster(lua_State *L);
+#endif
+#ifdef LSC_USE_OFFLOAD
+LSCLUA_API int luaopen_sched_offload(lua_State *L);
+#endif
 
 /* 
  * install lua module to Lua, so you can `require()` it.
- * will install "sched", "sched.signal" and "sched.task" module.
+ * will install "sched", "sched.signal", "sched.task", "sched.channel",
+ * "sched.sync" and "sched.future" module, and "sched.io" (with epoll
+ * backend), "sched.cluster" (LSC_USE_CLUSTER) and "sched.offload"
+ * (LSC_USE_OFFLOAD) if they are built.
  */
 LSC_API void lsc_install(lua_State *L);
 
@@ -105,7 +148,15 @@ LSC_API void lsc_install(lua_State *L);
 LSC_API lsc_State *lsc_state(lua_State *L);
 
 /* return the current task of lua state L,
- * or NULL if L is not a task.  */
+ * or NULL if L is not a task.
+ * the task running now is found at the end of the running queue, others
+ * need a lookup in registry table by default. on Lua 5.3+, if the
+ * host gives the extra space of threads (see `lua_getextraspace`) to
+ * sched by defining LSC_USE_EXTRASPACE, the task pointer is kept in
+ * it, so it's O(1) without any table lookup. the extra space of main
+ * thread is claimed when sched state created, and new coroutines copy
+ * it, so the state must be created before any coroutine, those
+ * created before have garbage in it. */
 LSC_API lsc_Task *lsc_current(lua_State *L);
 
 /* return the task object against lua main thread. */
@@ -118,13 +169,44 @@ LSC_API const char *lsc_collect(lua_State *L, lsc_State *s, lsc_Collect *clt, vo
 /* set poll function for once/loop */
 LSC_API void lsc_setpoll(lsc_State *s, lsc_Poll *poll, void *ud);
 
+/* return how long the poll function may block, in milliseconds.
+ * return 0 if there are tasks to run, -1 if nothing pending (block
+ * until some event comes), or the time to next timer expired. */
+LSC_API int lsc_nexttimeout(lsc_State *s);
+
+/* set the max nanoseconds to busy poll before blocking (0 disables,
+ * the default), return the old value. the builtin I/O backend spins
+ * in an adaptive window up to it: the window grows when events caught
+ * in spinning, and shrinks when spun in vain. other poll functions
+ * can read it from `s->spin`. */
+LSC_API unsigned long lsc_setspin(lsc_State *s, unsigned long max_ns);
+
+/* enable or disable trampolined wakeups, return the old value.
+ * when enabled, a task waked up (by `lsc_emit`, `lsc_wakeup`, etc.)
+ * inside another running task is not resumed at once, but queued and
+ * resumed by the outermost `lsc_wakeup` after the running task yields,
+ * in the same order. so a long chain of tasks waking up each other
+ * costs no C stack, but a nested `lsc_wakeup` returns before the task
+ * really runs. */
+LSC_API int lsc_settrampoline(lsc_State *s, int enable);
+
 /* run scheduler once.
  * return 1 if scheduler need run further,
  * return -1 if has tasks error out, 
  * or return 0 if scheduler needn't run. */
 LSC_API int lsc_once(lsc_State *s, lua_State *from);
 
+/* run scheduler once, just like `lsc_once`, but stop run ready tasks
+ * after max_tasks tasks run or max_ns nanoseconds passed (0 means no
+ * limit), the rest ready tasks are left to next tick, and poll
+ * function is always called. so poll function will not be delayed
+ * too long by a burst of ready tasks.  */
+LSC_API int lsc_oncex(lsc_State *s, lua_State *from,
+                      size_t max_tasks, lsc_Clock max_ns);
+
 /* run a loop.
+ * if no poll function is set, it sleeps between ticks until the next
+ * timer expired when no tasks are ready, instead of spinning.
  * return 1 if not more task is running,
  * or return 0 if has tasks error out. */
 LSC_API int lsc_loop(lsc_State *s, lua_State *from);
@@ -163,13 +245,17 @@ LSC_API void lsc_initsignal(lsc_Signal *s);
  */
 LSC_API lsc_Task *lsc_next(lsc_Signal *s, lsc_Task *curr);
 
-/* get the count of tasks that wait on signal s */
+/* get the count of tasks that wait on signal s, it's O(1) */
 LSC_API size_t lsc_count(lsc_Signal *s);
 
 /* get the task at idx for signal s, idx is 0-bases and can be
  * negative (reversed index).
- * note that this routine is O(n), use `lsc_next` if you want to
- * travrse tasks waitting on signal.  */
+ * the scheduler remembers the last signal indexed and the task found
+ * as a cursor (until a task removed from that signal), and walks from
+ * the nearest of head, tail and the cursor, so sequential indexing on
+ * a signal is O(1), but random indexing still O(n). there is only one
+ * cursor for a scheduler, so indexing two signals in turn walks from
+ * head or tail every time. */
 LSC_API lsc_Task *lsc_index(lsc_Signal *s, int idx);
 
 
@@ -180,6 +266,32 @@ LSC_API lsc_Task *lsc_index(lsc_Signal *s, int idx);
  */
 LSC_API lsc_Task *lsc_newtask(lua_State *L, lua_State *coro, size_t extrasz);
 
+/*
+ * create a new ready task runs the function at L's stack with nargs
+ * arguments above it, the function and arguments are replaced by the
+ * new task object, return the new task.
+ *
+ * the coroutine of the task is token from a pool owned by lsc_State,
+ * and returned to the pool when the task is deleted (if it's
+ * returned normally, or on Lua 5.4 it can be reset). a task finished
+ * without return values is deleted at once. the pool holds at most
+ * `lsc_setpoollimit` coroutines.
+ *
+ * so the function must not let its coroutine escape (e.g. by
+ * `coroutine.running()`), it will be reused by other tasks. create
+ * tasks of untrusted functions by `lsc_newtask` instead (`task.new` in
+ * Lua never pools coroutines).
+ *
+ * the coroutine is not token until the task first waked up: before
+ * that, the function and arguments are kept in task object, and t->L
+ * is NULL. (Lua 5.3+ only)
+ */
+LSC_API lsc_Task *lsc_spawn(lua_State *L, int nargs);
+
+/* set the high-water mark of coroutine pool, coroutines exceeded are
+ * freed.  */
+LSC_API void lsc_setpoollimit(lua_State *L, int limit);
+
 /*
  * delete the task. wake it up to tell the deletion (if it's waitting
  * something), and run all tasks joined on it, with nrets at t's
@@ -196,7 +308,9 @@ LSC_API int lsc_deletetask(lsc_Task *t, lua_State *from);
 LSC_API lsc_Task *lsc_checktask(lua_State *L, int idx);
 LSC_API lsc_Task *lsc_testtask(lua_State *L, int idx);
 
-/* push task t's lua object to lua stack */
+/* push task t's lua object to lua stack, return 0 if t is deleted.
+ * a finished task is not anchored by sched anymore, but it's pushed
+ * as long as its object is not collected. */
 LSC_API int lsc_pushtask(lua_State *L, lsc_Task *t);
 
 
@@ -293,7 +407,9 @@ LSC_API int lsc_wakeup(lsc_Task *t, lua_State *from, int nargs);
  * if nargs < 0, all tasks context will be the return values of waked
  * up tasks. if from != NULL and nargs > 0, nargs values at from will
  * replaced as tasks context and returned. after that, these values
- * will poped from state.
+ * will poped from state. the values are kept at from once and copied
+ * into each task's coroutine directly, so a broadcast to many tasks
+ * costs no more than waking them up one by one.
  *
  * if a task wait to s after wakeup, it will not wakeup again. you
  * should call emit again to wakeup it. i.e. every tasks on signal s
@@ -303,29 +419,430 @@ LSC_API int lsc_wakeup(lsc_Task *t, lua_State *from, int nargs);
  */
 LSC_API int lsc_emit(lsc_Signal *s, lua_State *from, int nargs);
 
+/* move all tasks waitting on s at once: make them ready, hold them,
+ * or make them wait on signal to instead. contexts of tasks are not
+ * touched, and a task waitting by `lsc_waitany` gets the index of s,
+ * just like `lsc_emit`.
+ *
+ * tasks are fixed up in one pass and spliced into the target queue,
+ * so it's much cheaper than `lsc_ready` them one by one.
+ *
+ * return the count of moved tasks. */
+LSC_API int lsc_readyall(lsc_Signal *s);
+LSC_API int lsc_holdall(lsc_Signal *s);
+LSC_API int lsc_moveall(lsc_Signal *from, lsc_Signal *to);
+
+
+/*
+ * priorities.
+ *
+ * every priority level has it's own ready queue, 0 is the highest
+ * level, and new tasks are at LSC_DEFAULT_PRIORITY.
+ *
+ * every tick `lsc_once` runs ready tasks from the highest level to
+ * the lowest. by default a level runs all of it's tasks, i.e. strict
+ * priority. if a quota is set to a level by `lsc_setquota`, at most
+ * quota tasks run in one tick, the rest are run before others in the
+ * next ticks. so a flood of tasks in low level can not delay tasks
+ * in higher levels for more than quota tasks.
+ */
+#ifndef LSC_PRIORITIES
+# define LSC_PRIORITIES 4
+#endif
+#ifndef LSC_DEFAULT_PRIORITY
+# define LSC_DEFAULT_PRIORITY 2
+#endif
+
+/* set priority level of task t, and return the previous level.
+ * level is clamped into [0, LSC_PRIORITIES). if t is ready, it
+ * will moved to the ready queue of new level. */
+LSC_API int lsc_setpriority(lsc_Task *t, int prio);
+
+/* set the quota of tasks run in one tick in level prio, 0 means no
+ * limit. return the previous quota. */
+LSC_API int lsc_setquota(lsc_State *s, int prio, int quota);
+
+
+/*
+ * runtime stats (define LSC_USE_STATS to enable).
+ *
+ * every task counts the times it resumed, the time it runs inside
+ * `lua_resume` (not including tasks it wakes up directly), and the
+ * time it spent on ready queue or waitting. they are updated by
+ * `lsc_wakeup` and `lsc_ready` with a monotonic clock. without
+ * LSC_USE_STATS, none of them are compiled in.
+ */
+#ifdef LSC_USE_STATS
+
+typedef struct lsc_TaskStats {
+    unsigned long resumes; /* times of resumed */
+    double cpu;            /* seconds runs in `lua_resume` */
+    double maxslice;       /* seconds of the longest resume */
+    double ready;          /* seconds on ready queue */
+    double wait;           /* seconds waitting or hold */
+} lsc_TaskStats;
+
+/* get stats of task t, the time in current status is included */
+LSC_API void lsc_taskstats(lsc_Task *t, lsc_TaskStats *stats);
+
+/* return the next task alive (i.e. not finished or deleted) in
+ * scheduler s, the previous task is curr, the first task will
+ * returned if curr == NULL, or NULL if no more tasks. */
+LSC_API lsc_Task *lsc_nexttask(lsc_State *s, lsc_Task *curr);
+
+#endif /* LSC_USE_STATS */
+
+
+/*
+ * metrics.
+ *
+ * the scheduler keeps some counters for health monitoring, without
+ * walking any task list. they are always compiled in, except the
+ * latency histogram, it needs the per-task clocks of LSC_USE_STATS,
+ * and is all zero without it.
+ *
+ * the latency from task ready to it runs are counted in a log-linear
+ * histogram (HDR-style): latencies less than 4 us are in bucket 0~3,
+ * and every power of 2 above is split into 4 buckets, i.e. bucket i
+ * (i >= 4) counts latencies in [(4 + i%4) << (i/4 - 1), (5 + i%4) <<
+ * (i/4 - 1)) microseconds. the last bucket counts all larger ones. */
+#ifndef LSC_LATENCY_BUCKETS
+# define LSC_LATENCY_BUCKETS 84 /* up to about 1 second */
+#endif
+
+typedef struct lsc_Metrics {
+    unsigned long ticks;      /* times of `lsc_once` */
+    unsigned long dispatched; /* tasks run from ready queues */
+    double runtime;           /* seconds running ready tasks */
+    double polltime;          /* seconds in poll function */
+    double uptime;            /* seconds since scheduler created */
+    size_t ready;             /* tasks on ready queues now */
+    size_t errors;            /* error tasks now */
+    double latencysum;        /* seconds of all ready-to-run latency */
+    unsigned long latency[LSC_LATENCY_BUCKETS];
+} lsc_Metrics;
+
+/* get a snapshot of the metrics of scheduler s */
+LSC_API void lsc_metrics(lsc_State *s, lsc_Metrics *m);
+
+/* return the lower bound of latency bucket idx, in microseconds */
+LSC_API unsigned long lsc_latencybound(int idx);
+
+/* format metrics m in Prometheus text exposition format, push it
+ * onto lua stack and return it. the latency histogram is only in it
+ * with LSC_USE_STATS. */
+LSC_API const char *lsc_pushprometheus(lua_State *L, const lsc_Metrics *m);
+
+
+/*
+ * tracing.
+ *
+ * after `lsc_tracestart`, scheduler events are recorded into a ring
+ * of fixed-size records allocated at start, so nothing allocates
+ * when recording, and the oldest records are overwritten when ring
+ * is full. the events are resumes (begin and end, with the waker
+ * task), waits (with the signal), readies, emits (with the signal)
+ * and the calls to poll function.
+ *
+ * `lsc_tracestop` writes records as Chrome trace-event JSON, which
+ * can be opened by Perfetto or chrome://tracing, every task is a
+ * track (tid) in it.
+ */
+#ifndef LSC_TRACE_SIZE
+# define LSC_TRACE_SIZE 65536
+#endif
+
+/* start tracing with a ring of size records (0 means default
+ * LSC_TRACE_SIZE), the records before are dropped. */
+LSC_API void lsc_tracestart(lua_State *L, size_t size);
+
+/* stop tracing, write records to file path if it's not NULL. return
+ * 0 and set errno if the file can not be written, or 1 otherwise. */
+LSC_API int lsc_tracestop(lua_State *L, const char *path);
+
+
+/*
+ * sampling profiler.
+ *
+ * after `lsc_profstart`, every task resumed by `lsc_wakeup` gets a
+ * count hook (see `lua_sethook`) while it runs, which records the Lua
+ * stack of task every count instructions, into a buffer allocated at
+ * start. hooks are only installed while profiling, so resumes pay
+ * nothing else, and hooks set by others are restored after resumes.
+ */
+#ifndef LSC_PROFILE_SAMPLES
+# define LSC_PROFILE_SAMPLES 10000
+#endif
+#ifndef LSC_PROFILE_STACK
+# define LSC_PROFILE_STACK 500 /* max bytes of a stack sample, the
+                                     root frames are dropped first */
+#endif
+
+/* start profiling, take a sample every count instructions (0 means
+ * 1000), and keep at most samples samples (0 means default
+ * LSC_PROFILE_SAMPLES), more samples are dropped. the samples before
+ * are dropped. */
+LSC_API void lsc_profstart(lua_State *L, int count, size_t samples);
+
+/* stop profiling, push the samples as folded stacks (a line of
+ * `task;frame;frame... count` per stack, for flamegraph.pl) onto lua
+ * stack, return it. the count of samples dropped is set to *dropped
+ * if it's not NULL. */
+LSC_API const char *lsc_profstop(lua_State *L, size_t *dropped);
+
+
+/*
+ * timers.
+ *
+ * every lsc_State owns a hierarchical timing wheel with millisecond
+ * resolution, so add or cancel a timer is O(1) and pending timers
+ * cost nothing until they expired. expired timers are fired by
+ * `lsc_once` before it runs the ready tasks.
+ *
+ * lsc_Time is a wrapping millisecond counter, compare them with
+ * `lsc_timediff`. deadlines can not farther than LONG_MAX
+ * milliseconds from now.
+ */
+typedef unsigned long lsc_Time;
+
+#define lsc_timediff(a, b) ((long)((lsc_Time)(a) - (lsc_Time)(b)))
+
+/* return the current time of monotonic clock, in milliseconds */
+LSC_API lsc_Time lsc_now(void);
+
+/* wait to a signal s, just like `lsc_wait`, but wait at most to
+ * deadline. if deadline reached before the signal emitted, task t
+ * will be ready to run, with context `nil, "timeout"`.
+ *
+ * if s == NULL, task t is just hold until deadline, and with empty
+ * context after that, i.e. sleep to deadline.
+ *
+ * any status changes of task t will cancel the deadline.
+ */
+LSC_API int lsc_waitfor(lsc_Task *t, lsc_Signal *s, lsc_Time deadline, int nctx);
+
+/* wait to any of n signals, just like `lsc_wait`, but task t will
+ * queued in all signals, the first one emitted will wake up it, and
+ * cancel the waitting on others.
+ *
+ * a wait node is token from a pool for every signal, duplicated
+ * signals are only waited once.
+ *
+ * when task t waked up, the 1-based index of the signal that wakes it
+ * up will inserted before the wakeup arguments, or nil if it's waked
+ * up by other ways, e.g. `lsc_wakeup` it directly.
+ */
+LSC_API int lsc_waitany(lsc_Task *t, lsc_Signal **signals, int n, int nctx);
+
+
+/*
+ * I/O readiness (Linux only, define LSC_NO_EPOLL to disable).
+ *
+ * every fd waited is registered to a epoll instance once, in
+ * edge-triggered mode, and has a signal for each direction. the poll
+ * function `lsc_iopoll` collects events in batch, and makes tasks
+ * waitting on the fd ready. it blocks when no tasks are ready,
+ * at most to the next timer expired.
+ *
+ * the first `lsc_waitfd` installs `lsc_iopoll` as the poll function
+ * if none is set, if you have your own poll function, call
+ * `lsc_iopoll` in it. the one set by `sched.setpoll` in Lua calls it
+ * after the Lua function.
+ *
+ * registered fds keep the loop running, use `lsc_closefd` before
+ * close the fd.
+ */
+#define LSC_IOREAD  1
+#define LSC_IOWRITE 2
+
+#ifdef LSC_USE_EPOLL
+
+#ifndef LSC_IO_BATCH
+# define LSC_IO_BATCH 128
+#endif
+
+/* wait fd to be readable (LSC_IOREAD) or writable (LSC_IOWRITE),
+ * just like `lsc_wait`. task t will get `true` as context when it
+ * waked up by the fd event, or `nil, "closed"` by `lsc_closefd`.
+ *
+ * in edge-triggered mode, events got when no task waitting are
+ * remembered, in this case the event is consumed and return 1 at
+ * once without waitting, so do I/O until it would block before
+ * calling `lsc_waitfd`.
+ *
+ * return -1 if fd can not be registered, the errno is set. */
+LSC_API int lsc_waitfd(lsc_Task *t, int fd, int events, int nctx);
+
+/* unregister fd, wakeup all tasks waitting on it with context `nil,
+ * "closed"`. return 0 if fd is not registered. */
+LSC_API int lsc_closefd(lua_State *L, int fd);
+
+/* the lsc_Poll for epoll backend, ud is not used. */
+LSC_API int lsc_iopoll(lsc_State *s, lua_State *from, void *ud);
+
+#endif /* LSC_USE_EPOLL */
+
+
+/*
+ * cluster (needs the epoll backend, pthreads and the __atomic builtins
+ * of GCC or Clang, define LSC_USE_CLUSTER to enable).
+ *
+ * a cluster runs a Lua chunk in n threads, each thread is a worker
+ * with it's own lua_State and lsc_State, and the state starts the
+ * cluster is the worker 0. workers send values to each other through
+ * lock-free MPSC mailboxes, values are serialised, only nil, boolean,
+ * number, string and tables of them can be sent. `lsc_once` delivers
+ * arrived messages to the tasks waitting on the mailbox and makes them
+ * ready, a message for every task, the rest are kept in mailbox until some task wait
+ * again. mailbox keeps the loop running only when tasks waitting on
+ * it (if `lsc_iopoll` is used).
+ *
+ * the cluster is created by `sched.cluster.start()`, see README.
+ */
+#ifdef LSC_USE_CLUSTER
+
+#ifndef LSC_CLUSTER_BATCH
+# define LSC_CLUSTER_BATCH 256 /* messages delivered in one tick */
+#endif
+
+/* send the top nargs values of L to worker `to`, the worker gets the
+ * worker id of L and the values. return 0 if L is not in a cluster
+ * or `to` is not a worker. */
+LSC_API int lsc_send(lua_State *L, int to, int nargs);
+
+#endif /* LSC_USE_CLUSTER */
+
+
+/*
+ * offload (needs the epoll backend and pthreads, define
+ * LSC_USE_OFFLOAD to enable).
+ *
+ * a blocking call in task stalls the whole scheduler, offload it to
+ * a pool of LSC_OFFLOAD_THREADS threads instead. the pool is created
+ * at the first time used, and completions are posted back through an
+ * eventfd, the poll function `lsc_iopoll` wakes up tasks with results.
+ */
+#ifdef LSC_USE_OFFLOAD
+
+#ifndef LSC_OFFLOAD_THREADS
+# define LSC_OFFLOAD_THREADS 4
+#endif
+
+/* runs in pool thread, can not touch any Lua things */
+typedef void lsc_Work(void *ud);
+
+/* runs in scheduler after work done, push results of work to L and
+ * return the count of them. if the task is not waitting the work
+ * anymore (e.g. deleted), L is NULL, just free resources. */
+typedef int lsc_WorkDone(lua_State *L, void *ud);
+
+/* make task t waitting (just like `lsc_wait`), run work(ud) in pool
+ * thread, and then done(L, ud) in scheduler, the results pushed by
+ * done are passed to task t when it waked up.
+ *
+ * return -1 if task t is dead or the pool can not be created, the
+ * errno is set, and done will not called. */
+LSC_API int lsc_offload(lsc_Task *t, lsc_Work *work, lsc_WorkDone *done, void *ud);
+
+#endif /* LSC_USE_OFFLOAD */
+
 
 /* all fields in structure are READ-ONLY */
 
+#define LSC_WHEEL_ROOTBITS 8
+#define LSC_WHEEL_BITS     6
+#define LSC_WHEEL_LEVELS   4
+#define LSC_WHEEL_ROOTSIZE (1 << LSC_WHEEL_ROOTBITS)
+#define LSC_WHEEL_SIZE     (1 << LSC_WHEEL_BITS)
+
+#ifndef LSC_POOL_LIMIT
+# define LSC_POOL_LIMIT 64
+#endif
+
+typedef struct lsc_Timer {
+    struct lsc_Timer *prev;
+    struct lsc_Timer *next;
+    lsc_Time expire;
+} lsc_Timer;
+
 struct lsc_Signal {
     struct lsc_Signal *prev;
     struct lsc_Signal *next;
 };
 
+/* node of `lsc_waitany`, shares the beginning layout with lsc_Task,
+ * so signals can queue both of them. the first node of a queue keeps
+ * the count of the queue, so lsc_Signal needn't it. */
+typedef struct lsc_WaitNode {
+    lsc_Signal head;
+    lsc_Task *task;
+    lsc_Signal *owner; /* queue this node linked in */
+    size_t count; /* nodes in owner, only for the first node */
+    lsc_Signal *waitat;
+    struct lsc_WaitNode *next;
+    int index;
+} lsc_WaitNode;
+
 struct lsc_Task {
     lsc_Signal head;
+    lsc_Task *self; /* see lsc_WaitNode */
+    lsc_Signal *owner;
+    size_t count;
     lsc_Signal joined;
     lsc_State *S;
     lua_State *L;
     lsc_Signal *waitat;
+    lsc_Timer timer;
+    lsc_WaitNode *nodes;
+    int fired; /* signal index for lsc_waitany, or -1 */
+    int ref; /* reference of task object in registry */
+    int spawned; /* coroutine comes from pool, see `lsc_spawn` */
+    int lazy; /* values kept for unstarted task, see `lsc_spawn` */
+    int priority;
+#ifdef LSC_USE_STATS
+    lsc_TaskStats stats;
+    lsc_Clock since; /* clock of last status changed */
+    lsc_Task *prevtask, *nexttask; /* list of tasks alive */
+#endif
 };
 
 struct lsc_State {
     lsc_Signal running;
-    lsc_Signal ready;
+    lsc_Signal ready[LSC_PRIORITIES];
+    lsc_Signal batch[LSC_PRIORITIES]; /* running in this tick */
+    int quota[LSC_PRIORITIES];
     lsc_Signal error;
     lsc_Task *main;
     void *ud;
     lsc_Poll *poll;
+    lsc_WaitNode *freenodes;
+    int npool;     /* coroutines in pool */
+    int poollimit; /* high-water mark of pool */
+    size_t poolhits, poolmisses;
+    lsc_Time now; /* next tick of timing wheel */
+    size_t ntimers;
+    unsigned long spin; /* max ns to busy poll, see `lsc_setspin` */
+    void *io; /* epoll backend, see `lsc_waitfd` */
+    void *mailbox; /* mailbox in cluster, see `lsc_send` */
+    void *trace; /* ring of trace records, see `lsc_tracestart` */
+    void *profile; /* samples of profiler, see `lsc_profstart` */
+    lsc_Task *proftask; /* task resumed by `prof_resume` */
+    int trampoline; /* see `lsc_settrampoline` */
+    int depth; /* nested `lsc_wakeup` */
+    int draining; /* deferred wakeups are running */
+    int fired; /* t->fired of the task resuming, see `select_resume` */
+    lsc_Signal deferred; /* nested wakeups to run */
+    lsc_Signal *cursorq; /* signal indexed last, see `lsc_index` */
+    lsc_Signal *cursor; /* node found at last, and it's index */
+    size_t cursoridx;
+    lsc_Time born; /* for uptime in metrics */
+    lsc_Metrics metrics; /* counters only, see `lsc_metrics` */
+#ifdef LSC_USE_STATS
+    lsc_Task *tasks; /* all tasks alive, see `lsc_nexttask` */
+    double resumed; /* seconds in all `lua_resume`, for nested ones */
+#endif
+    lsc_Timer root[LSC_WHEEL_ROOTSIZE];
+    lsc_Timer wheel[LSC_WHEEL_LEVELS][LSC_WHEEL_SIZE];
 };
 
 
@@ -336,16 +853,71 @@ LSC_NS_END
 
 #ifdef LSC_IMPLEMENTATION
 
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+#ifdef LSC_USE_EPOLL
+# include <sys/epoll.h>
+# include <errno.h>
+# include <unistd.h>
+#endif
+#if defined(LSC_USE_CLUSTER) || defined(LSC_USE_OFFLOAD)
+# include <pthread.h>
+# include <stdlib.h>
+# include <sys/eventfd.h>
+#endif
+#ifdef LSC_USE_CLUSTER
+# include <lualib.h>
+#endif
+#ifdef LSC_USE_OFFLOAD
+# include <arpa/inet.h>
+# include <netdb.h>
+# include <sys/socket.h>
+#endif
+
 LSC_NS_BEGIN
 
 
 #include <lauxlib.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
 
 #define LSC_MAIN_STATE 0x15CEA125
+#define LSC_IO_STATE   0x105CA125
+#define LSC_POLL_CTX   0x9011C7C5
+#define LSC_CLUSTER    0xC1057E85
+#define LSC_OFFLOAD    0x0FF10AD5
+#define LSC_TRACE      0x00007ACE
+#define LSC_PROFILE    0x0009F11E
 #define LSC_TASK_BOX   0x7A58B085
+#define LSC_NODE_BOX   0x90DEB085
+#define LSC_POOL_BOX   0xC0B00085
+#define LSC_IO_BOX     0x10FDB085
+#define LSC_WEAK_BOX   0x3EA6B085
+#define LSC_NODE_BLOCK 32
+
+#if LUA_VERSION_NUM >= 503
+# define LSC_LAZY_TASK /* see `lsc_spawn` */
+#else
+# undef LSC_USE_EXTRASPACE
+#endif
+
+#ifdef LSC_USE_EXTRASPACE
+# define thread_task(L) (*(lsc_Task**)lua_getextraspace(L))
+#endif
+
+#if LUA_VERSION_NUM >= 504
+# if LUA_VERSION_RELEASE_NUM >= 50406
+#  define lua54_closethread lua_closethread
+# else
+#  define lua54_closethread(L, from) lua_resetthread(L)
+# endif
+#endif
 
 #if LUA_VERSION_NUM >= 503
 # define lua53_rawgetp lua_rawgetp
@@ -358,780 +930,4339 @@ static int lua53_rawgeti(lua_State *L, int idx, lua_Integer i)
 #endif
 
 
-static void get_taskbox(lua_State *L) {
-    if (lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_TASK_BOX) == LUA_TTABLE)
+static void get_box(lua_State *L, void *key) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE)
         return;
     lua_pop(L, 1);
     lua_newtable(L); /* no weak? */
     lua_pushvalue(L, -1);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_TASK_BOX);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
 }
 
-LSC_API lsc_State *lsc_state(lua_State *L) {
-    lsc_State *s;
-    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_MAIN_STATE);
-    s = (lsc_State*)lua_touserdata(L, -1);
+#define get_taskbox(L) get_box((L), (void*)LSC_TASK_BOX)
+#define get_nodebox(L) get_box((L), (void*)LSC_NODE_BOX)
+#define get_poolbox(L) get_box((L), (void*)LSC_POOL_BOX)
+#define get_iobox(L)   get_box((L), (void*)LSC_IO_BOX)
+
+static void get_weakbox(lua_State *L) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_WEAK_BOX) == LUA_TTABLE)
+        return;
     lua_pop(L, 1);
-    if (s != NULL) return s;
-    s = (lsc_State*)lua_newuserdata(L, sizeof(lsc_State));
-    s->main = NULL;
-    s->ud = NULL;
-    s->poll = NULL;
-    lsc_initsignal(&s->running);
-    lsc_initsignal(&s->ready);
-    lsc_initsignal(&s->error);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_MAIN_STATE);
-    lsc_maintask(L); /* init main task */
-    return s;
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_WEAK_BOX);
 }
 
 
-/* signal maintains */
+/* timer maintains */
 
-static void queue_removeself(lsc_Signal *head) {
-    if (head->prev && head->prev != head) {
-        head->prev->next = head->next;
-        head->next->prev = head->prev;
-    }
+#define timer_task(tm) \
+    ((lsc_Task*)((char*)(tm) - offsetof(lsc_Task, timer)))
+#define wheel_shift(lv) (LSC_WHEEL_ROOTBITS + (lv)*LSC_WHEEL_BITS)
+#define wheel_index(time, lv) \
+    (((time) >> wheel_shift(lv)) & (LSC_WHEEL_SIZE - 1))
+
+LSC_API lsc_Time lsc_now(void) {
+#ifdef _WIN32
+    return (lsc_Time)GetTickCount();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lsc_Time)ts.tv_sec * 1000 + (lsc_Time)ts.tv_nsec / 1000000;
+#endif
 }
 
-static void queue_append(lsc_Signal *head, lsc_Signal *to) {
-    queue_removeself(head);
-    if (to->prev) {
-        head->prev = to->prev;
-        head->prev->next = head;
-        head->next = to;
-        to->prev = head;
-    }
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+#endif
 }
 
-static void queue_replace(lsc_Signal *head, lsc_Signal *to) {
-    if (to->prev) {
-        head->prev = to->prev;
-        head->prev->next = head;
-        head->next = to->next;
-        head->next->prev = head;
-        to->prev = to->next = NULL; /* invalid queue */
-    }
-    else 
-        head->prev = head->next = head;
+static lsc_Clock clock_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    lsc_Clock q, r, f;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    /* in integers, now * 1e9 overflows */
+    f = (lsc_Clock)freq.QuadPart;
+    q = (lsc_Clock)now.QuadPart / f;
+    r = (lsc_Clock)now.QuadPart % f;
+    return q * 1000000000 + r * 1000000000 / f;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lsc_Clock)ts.tv_sec * 1000000000 + (lsc_Clock)ts.tv_nsec;
+#endif
 }
 
-static int queue_task(lsc_Task *t, lsc_Signal *s) {
-    queue_append(&t->head, t->waitat = s);
-    return 1;
+static void timer_init(lsc_Timer *tm) {
+    tm->prev = tm->next = tm;
 }
 
-LSC_API lsc_Signal *lsc_newsignal(lua_State *L, size_t extrasz) {
-    lsc_Signal *s =
-        (lsc_Signal*)lua_newuserdata(L, sizeof(lsc_Signal) + extrasz);
-    luaL_setmetatable(L, "sched.signal");
-    lsc_initsignal(s);
-    return s;
+static void timer_link(lsc_Timer *tm, lsc_Timer *head) {
+    tm->prev = head->prev;
+    tm->prev->next = tm;
+    tm->next = head;
+    head->prev = tm;
 }
 
-LSC_API void lsc_deletesignal(lsc_Signal *s, lua_State *from) {
-    lsc_Signal removed;
-    lsc_Task *t = NULL;
-    /* replace and invalid signal */
-    queue_replace(&removed, s);
-    while ((t = lsc_next(&removed, NULL)) != NULL) {
-        lua_pushnil(t->L);
-        lua_pushstring(t->L, "signal deleted");
-        lsc_wakeup(t, from, 2);
-        assert(t->waitat != &removed);
+static void timer_place(lsc_State *s, lsc_Timer *tm) {
+    long idx = lsc_timediff(tm->expire, s->now);
+    int lv;
+    if (idx < 0) /* already expired, fire at next tick */
+        timer_link(tm, &s->root[s->now & (LSC_WHEEL_ROOTSIZE - 1)]);
+    else if (idx < LSC_WHEEL_ROOTSIZE)
+        timer_link(tm, &s->root[tm->expire & (LSC_WHEEL_ROOTSIZE - 1)]);
+    else {
+        /* the top level catches all farther timers, they will be
+         * placed again when cascading, until they are near enough */
+        for (lv = 0; lv < LSC_WHEEL_LEVELS - 1; ++lv)
+            if ((idx >> wheel_shift(lv + 1)) == 0)
+                break;
+        timer_link(tm, &s->wheel[lv][wheel_index(tm->expire, lv)]);
     }
 }
 
-LSC_API void lsc_initsignal(lsc_Signal *s) {
-    s->prev = s->next = s;
+static void timer_remove(lsc_State *s, lsc_Timer *tm) {
+    if (tm->next != tm) {
+        tm->prev->next = tm->next;
+        tm->next->prev = tm->prev;
+        timer_init(tm);
+        --s->ntimers;
+    }
 }
 
-LSC_API int lsc_signalvalid(lsc_Signal *s) {
-    return s->prev != NULL;
+static void timer_insert(lsc_State *s, lsc_Timer *tm, lsc_Time expire) {
+    timer_remove(s, tm);
+    if (s->ntimers++ == 0)
+        s->now = lsc_now(); /* wheel is idle, catch up the clock */
+    tm->expire = expire;
+    timer_place(s, tm);
 }
 
-LSC_API lsc_Task *lsc_next(lsc_Signal *s, lsc_Task *curr) {
-    if (curr == NULL)
-        return s->prev == s ? NULL : (lsc_Task*)s->next;
-    return curr->head.next == s ?
-        NULL : (lsc_Task*)curr->head.next;
+#ifdef LSC_LAZY_TASK
+static lua_State *task_state(lsc_Task *t);
+#else
+# define task_state(t) ((t)->L)
+#endif
+
+static void timer_fire(lsc_Timer *tm) {
+    lsc_Task *t = timer_task(tm);
+    lua_State *L = task_state(t);
+    timer_remove(t->S, tm);
+    lsc_setcontext(L, t, 0); /* clean up context */
+    if (t->waitat != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, "timeout");
+    }
+    lsc_ready(t, lua_gettop(L));
 }
 
-LSC_API size_t lsc_count(lsc_Signal *s) {
-    lsc_Task *t = NULL;
-    size_t count = 0;
-    while ((t = lsc_next(s, t)) != NULL)
-        ++count;
-    return count;
+static void init_wheel(lsc_State *s) {
+    int i, lv;
+    s->now = lsc_now();
+    s->ntimers = 0;
+    for (i = 0; i < LSC_WHEEL_ROOTSIZE; ++i)
+        timer_init(&s->root[i]);
+    for (lv = 0; lv < LSC_WHEEL_LEVELS; ++lv)
+        for (i = 0; i < LSC_WHEEL_SIZE; ++i)
+            timer_init(&s->wheel[lv][i]);
 }
 
-LSC_API lsc_Task *lsc_index(lsc_Signal *s, int idx) {
-    if (!lsc_signalvalid(s)) /* handle deleted signal */
-        return NULL;
-    if (idx >= 0) {
-        lsc_Task *t = NULL;
-        while (idx >= 0 && (t = lsc_next(s, t)) != NULL)
-            --idx;
-        return t;
-    }
-    else {
-        lsc_Signal *head = s;
-        while (idx < 0 && head->prev != s) {
-            head = head->prev;
-            ++idx;
-        }
-        if (idx < 0)
-            return NULL;
-        return (lsc_Task*)head;
+static int cascade_wheel(lsc_State *s, int lv) {
+    int idx = (int)wheel_index(s->now, lv);
+    lsc_Timer *head = &s->wheel[lv][idx];
+    while (head->next != head) {
+        lsc_Timer *tm = head->next;
+        head->next = tm->next;
+        tm->next->prev = head;
+        timer_place(s, tm);
     }
+    return idx;
 }
 
-/* task maintains */
-
-static void register_task(lua_State *L, lsc_Task *t) {
-    /* stack: task object */
-    get_taskbox(L);
-    lua_pushthread(t->L);
-    if (t->L != L)
-        lua_xmove(t->L, L, 1); /* push thread */
-    lua_pushvalue(L, -3); /* task object */
-    lua_rawset(L, -3);
-    lua_pop(L, 1);
+static void update_wheel(lsc_State *s, lsc_Time now) {
+    while (s->ntimers != 0 && lsc_timediff(now, s->now) >= 0) {
+        int lv, idx = (int)(s->now & (LSC_WHEEL_ROOTSIZE - 1));
+        lsc_Timer *head = &s->root[idx], expired;
+        for (lv = 0; idx == 0 && lv < LSC_WHEEL_LEVELS; ++lv)
+            if (cascade_wheel(s, lv) != 0)
+                break;
+        ++s->now;
+        if (head->next == head)
+            continue;
+        /* detach expired timers */
+        expired.next = head->next;
+        expired.prev = head->prev;
+        expired.next->prev = expired.prev->next = &expired;
+        timer_init(head);
+        while (expired.next != &expired)
+            timer_fire(expired.next);
+    }
 }
 
-static void unregister_task(lsc_Task *t) {
-    get_taskbox(t->L);
-    lua_pushthread(t->L);
-    lua_pushnil(t->L);
-    lua_rawset(t->L, -3);
-    lua_pop(t->L, 1);
+static int next_timeout(lsc_State *s) {
+    /* milliseconds to the next timer expired, or -1 if no timers */
+    int i, edge = (int)(-s->now & (LSC_WHEEL_ROOTSIZE - 1));
+    long diff;
+    if (s->ntimers == 0) return -1;
+    /* timers in root wheel expire in slot order, the farther ones
+     * come only after cascading at the edge of root wheel */
+    for (i = 0; i < edge; ++i) {
+        lsc_Timer *head = &s->root[(s->now + i) & (LSC_WHEEL_ROOTSIZE - 1)];
+        if (head->next != head)
+            break;
+    }
+    diff = lsc_timediff(s->now + i, lsc_now());
+    return diff < 0 ? 0 : (int)diff;
 }
 
-LSC_API lsc_Task *lsc_newtask(lua_State *L, lua_State *coro, size_t extrasz) {
-    lsc_Task *t = (lsc_Task*)lua_newuserdata(L, sizeof(lsc_Task) + extrasz);
+LSC_API lsc_State *lsc_state(lua_State *L) {
+    lsc_State *s;
+    int i;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_MAIN_STATE);
+    s = (lsc_State*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (s != NULL) return s;
+    s = (lsc_State*)lua_newuserdata(L, sizeof(lsc_State));
+    s->main = NULL;
+    s->ud = NULL;
+    s->poll = NULL;
+    s->freenodes = NULL;
+    s->npool = 0;
+    s->poollimit = LSC_POOL_LIMIT;
+    s->poolhits = s->poolmisses = 0;
+    s->spin = 0;
+    s->io = NULL;
+    s->mailbox = NULL;
+    s->trace = NULL;
+    s->profile = NULL;
+    s->proftask = NULL;
+    s->trampoline = s->depth = s->draining = 0;
+    s->fired = -1;
+    lsc_initsignal(&s->deferred);
+    s->cursorq = s->cursor = NULL;
+    s->cursoridx = 0;
+    s->born = lsc_now();
+    memset(&s->metrics, 0, sizeof(lsc_Metrics));
+#ifdef LSC_USE_STATS
+    s->tasks = NULL;
+    s->resumed = 0;
+#endif
+    lsc_initsignal(&s->running);
+    for (i = 0; i < LSC_PRIORITIES; ++i) {
+        lsc_initsignal(&s->ready[i]);
+        lsc_initsignal(&s->batch[i]);
+        s->quota[i] = 0;
+    }
+    lsc_initsignal(&s->error);
+    init_wheel(s);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_MAIN_STATE);
+    lsc_maintask(L); /* init main task, it claims extra space of main
+                        thread if LSC_USE_EXTRASPACE */
+    return s;
+}
+
+
+/* tracing */
+
+enum trace_type {
+    TRACE_RESUME, TRACE_RESUMEEND, TRACE_WAIT, TRACE_READY, TRACE_EMIT,
+    TRACE_POLL, TRACE_POLLEND
+};
+
+typedef struct trace_record {
+    lsc_Clock ts; /* clock in ns */
+    int type;
+    const void *task;
+    const void *obj; /* signal, or waker task of resumes */
+} trace_record;
+
+typedef struct trace_ring {
+    size_t size, count; /* capacity, and records ever written */
+    lsc_Clock start;
+    trace_record records[1];
+} trace_ring;
+
+#define trace_event(S,type,t,obj) ((S)->trace == NULL ? (void)0 : \
+        trace_add((trace_ring*)(S)->trace, (type), (t), (obj)))
+
+/* the task at the end of running queue is running now */
+#define trace_current(S) ((S)->running.prev == &(S)->running ? NULL : \
+        node_task((S)->running.prev))
+
+static void trace_add(trace_ring *r, int type, const void *t, const void *obj) {
+    trace_record *rec = &r->records[r->count++ % r->size];
+    rec->ts = clock_ns();
+    rec->type = type;
+    rec->task = t;
+    rec->obj = obj;
+}
+
+static void trace_write(trace_ring *r, FILE *fp) {
+    static const char *names[] = {
+        "run", "run", "wait", "ready", "emit", "poll", "poll"
+    };
+    size_t i = r->count > r->size ? r->count - r->size : 0;
+    lsc_Clock prev = r->start;
+    double ts = 0; /* in us, summed by differences */
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"lua-sched\"}}");
+    for (; i < r->count; ++i) {
+        trace_record *rec = &r->records[i % r->size];
+        ts += (double)(rec->ts - prev) / 1000;
+        prev = rec->ts;
+        fprintf(fp, ",\n{\"name\":\"%s\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f",
+                names[rec->type], (unsigned long)(size_t)rec->task, ts);
+        switch (rec->type) {
+        case TRACE_RESUME:
+            fprintf(fp, ",\"ph\":\"B\",\"args\":{\"waker\":\"%p\"}}",
+                    rec->obj);
+            break;
+        case TRACE_RESUMEEND: case TRACE_POLLEND:
+            fputs(",\"ph\":\"E\"}", fp);
+            break;
+        case TRACE_POLL:
+            fputs(",\"ph\":\"B\"}", fp);
+            break;
+        case TRACE_WAIT: case TRACE_EMIT:
+            fprintf(fp, ",\"ph\":\"i\",\"s\":\"t\","
+                    "\"args\":{\"signal\":\"%p\"}}", rec->obj);
+            break;
+        default:
+            fputs(",\"ph\":\"i\",\"s\":\"t\"}", fp);
+        }
+    }
+    fputs("\n]}\n", fp);
+}
+
+LSC_API void lsc_tracestart(lua_State *L, size_t size) {
+    lsc_State *S = lsc_state(L);
+    trace_ring *r;
+    if (size == 0) size = LSC_TRACE_SIZE;
+    r = (trace_ring*)lua_newuserdata(L,
+            sizeof(trace_ring) + (size - 1) * sizeof(trace_record));
+    r->size = size;
+    r->count = 0;
+    r->start = clock_ns();
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_TRACE); /* anchor it */
+    S->trace = r;
+}
+
+LSC_API int lsc_tracestop(lua_State *L, const char *path) {
+    lsc_State *S = lsc_state(L);
+    trace_ring *r = (trace_ring*)S->trace;
+    int res = 1;
+    FILE *fp;
+    if (r == NULL) return 1;
+    S->trace = NULL;
+    if (path != NULL) {
+        if ((fp = fopen(path, "w")) == NULL)
+            res = 0;
+        else {
+            trace_write(r, fp);
+            res = !ferror(fp);
+            res = fclose(fp) == 0 && res;
+        }
+    }
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_TRACE);
+    return res;
+}
+
+
+/* profiler */
+
+typedef struct prof_sample {
+    const void *task;
+    char stack[LSC_PROFILE_STACK]; /* folded, root frame first */
+} prof_sample;
+
+typedef struct prof_buffer {
+    int count; /* instructions per sample */
+    size_t size, used, dropped;
+    prof_sample samples[1];
+} prof_buffer;
+
+
+static char *prof_frame(char *b, char *s, lua_Debug *ar, int leaf) {
+    /* put frame ar before s (frames are walked from leaf), b is the
+     * begin of buffer, return the new begin, or NULL if no room */
+    char buff[LUA_IDSIZE + 64];
+    const char *name = ar->name != NULL ? ar->name : "?";
+    size_t i, len;
+    if (*ar->what == 'C')
+        sprintf(buff, "%.32s [C]", name);
+    else if (*ar->what == 'm')
+        sprintf(buff, "main chunk (%s)", ar->short_src);
+    else
+        sprintf(buff, "%.32s (%s:%d)", name, ar->short_src,
+                ar->linedefined);
+    len = strlen(buff);
+    if ((size_t)(s - b) < len + !leaf)
+        return NULL;
+    s -= len + !leaf;
+    for (i = 0; i < len; ++i)
+        s[i] = buff[i] == ';' ? ',' : buff[i]; /* ';' separates frames */
+    if (!leaf) s[len] = ';';
+    return s;
+}
+
+static void prof_hook(lua_State *L, lua_Debug *ar) {
+    /* the task resumed by `prof_resume` is kept by the state, so the
+     * hook needs no lookup of task box */
+#ifdef LSC_USE_EXTRASPACE
+    lsc_Task *t = thread_task(L);
+    lsc_State *S = t != NULL ? t->S : lsc_state(L);
+#else
+    lsc_State *S = lsc_state(L);
+    lsc_Task *t = S->proftask;
+#endif
+    prof_buffer *p = (prof_buffer*)S->profile;
+    prof_sample *sample;
+    lua_Debug frame;
+    char *s, *e, *b;
+    int depth;
+    if (p == NULL) { /* stopped, or a coroutine inherited the hook */
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
+    if (p->used == p->size) {
+        ++p->dropped;
+        return;
+    }
+    sample = &p->samples[p->used++];
+    sample->task = t != NULL && t->L == L ? t : lsc_current(L);
+    /* walk stack once, fill frames backward from the end of buffer,
+     * the root frames are dropped if it's full */
+    s = e = sample->stack + LSC_PROFILE_STACK - 1;
+    for (depth = 0; lua_getstack(L, depth, &frame); ++depth) {
+        lua_getinfo(L, "Sn", &frame);
+        if ((b = prof_frame(sample->stack, s, &frame, depth == 0)) == NULL)
+            break;
+        s = b;
+    }
+    memmove(sample->stack, s, (size_t)(e - s));
+    sample->stack[e - s] = '\0';
+}
+
+static int prof_resume(lsc_Task *t, lua_State *from, int nargs) {
+    prof_buffer *p = (prof_buffer*)t->S->profile;
+    lua_Hook hook = lua_gethook(t->L);
+    int mask = lua_gethookmask(t->L);
+    int count = lua_gethookcount(t->L);
+    lsc_Task *prev = t->S->proftask; /* resumes may be nested */
+    int res;
+    if (hook == prof_hook) /* inherited from a profiled coroutine */
+        hook = NULL, mask = count = 0;
+    t->S->proftask = t;
+    lua_sethook(t->L, prof_hook, LUA_MASKCOUNT, p->count);
+    res = lua_resume(t->L, from, nargs);
+    lua_sethook(t->L, hook, mask, count);
+    t->S->proftask = prev;
+    return res;
+}
+
+LSC_API void lsc_profstart(lua_State *L, int count, size_t samples) {
+    lsc_State *S = lsc_state(L);
+    prof_buffer *p;
+    if (samples == 0) samples = LSC_PROFILE_SAMPLES;
+    p = (prof_buffer*)lua_newuserdata(L,
+            sizeof(prof_buffer) + (samples - 1) * sizeof(prof_sample));
+    p->count = count > 0 ? count : 1000;
+    p->size = samples;
+    p->used = p->dropped = 0;
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_PROFILE); /* anchor it */
+    S->profile = p;
+}
+
+LSC_API const char *lsc_profstop(lua_State *L, size_t *dropped) {
+    lsc_State *S = lsc_state(L);
+    prof_buffer *p = (prof_buffer*)S->profile;
+    luaL_Buffer b;
+    size_t i;
+    int n, counts;
+    if (dropped != NULL)
+        *dropped = p != NULL ? p->dropped : 0;
+    if (p == NULL) {
+        lua_pushliteral(L, "");
+        return lua_tostring(L, -1);
+    }
+    S->profile = NULL;
+    /* count samples by stacks */
+    lua_newtable(L);
+    counts = lua_gettop(L);
+    for (i = 0; i < p->used; ++i) {
+        lua_pushfstring(L, "task(%p);%s", p->samples[i].task,
+                p->samples[i].stack);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, counts);
+        lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+        lua_replace(L, -2);
+        lua_rawset(L, counts);
+    }
+    lua_newtable(L); /* lines */
+    lua_pushnil(L);
+    for (n = 0; lua_next(L, counts); lua_rawseti(L, counts + 1, ++n)) {
+        lua_pushfstring(L, "%s %d\n", lua_tostring(L, -2),
+                (int)lua_tointeger(L, -1));
+        lua_replace(L, -2);
+    }
+    luaL_buffinit(L, &b);
+    for (i = 1; i <= (size_t)n; ++i) {
+        lua_rawgeti(L, counts + 1, (int)i);
+        luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+    lua_replace(L, counts);
+    lua_settop(L, counts);
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_PROFILE);
+    return lua_tostring(L, -1);
+}
+
+
+/* signal maintains */
+
+#define node_task(n)  (((lsc_WaitNode*)(n))->task)
+#define node_owner(n) (((lsc_WaitNode*)(n))->owner)
+#define node_count(n) (((lsc_WaitNode*)(n))->count)
+
+/* nodes in queue q, kept by it's first node */
+#define queue_count(q) ((q)->prev == NULL || (q)->next == (q) ? \
+        0 : node_count((q)->next))
+
+static void cursor_reset(lsc_State *S, lsc_Signal *q) {
+    /* nodes of q are changed, see `lsc_index` */
+    if (S->cursorq == q)
+        S->cursorq = NULL;
+}
+
+static void node_init(lsc_Signal *head) {
+    /* head is a lsc_Task or lsc_WaitNode, not linked in any queue */
+    head->prev = head->next = head;
+    node_owner(head) = NULL;
+    node_count(head) = 0;
+}
+
+static void queue_removeself(lsc_Signal *head) {
+    lsc_Signal *q = node_owner(head);
+    if (q != NULL) {
+        cursor_reset(node_task(head)->S, q);
+        if (q->next != head)
+            --node_count(q->next);
+        else if (head->next != q) /* next node becomes the first */
+            node_count(head->next) = node_count(head) - 1;
+        node_owner(head) = NULL;
+    }
+    if (head->prev && head->prev != head) {
+        head->prev->next = head->next;
+        head->next->prev = head->prev;
+        head->prev = head->next = head;
+    }
+}
+
+static void queue_append(lsc_Signal *head, lsc_Signal *to) {
+    queue_removeself(head);
+    if (to->prev) {
+        if (to->next == to)
+            node_count(head) = 1;
+        else
+            ++node_count(to->next);
+        head->prev = to->prev;
+        head->prev->next = head;
+        head->next = to;
+        to->prev = head;
+        node_owner(head) = to;
+    }
+}
+
+static void queue_replace(lsc_Signal *head, lsc_Signal *to) {
+    /* move nodes of `to` to head, the caller resets the cursor of
+     * both before, see `lsc_index` */
+    head->prev = head->next = head;
+    if (to->prev) {
+        lsc_Signal *node;
+        if (to->prev == to) { /* empty queue */
+            to->prev = to->next = NULL; /* invalid queue */
+            return;
+        }
+        head->prev = to->prev;
+        head->prev->next = head;
+        head->next = to->next;
+        head->next->prev = head;
+        for (node = head->next; node != head; node = node->next)
+            node_owner(node) = head;
+        to->prev = to->next = NULL; /* invalid queue */
+    }
+}
+
+static lsc_WaitNode *new_node(lsc_Task *t) {
+    lsc_State *S = t->S;
+    lsc_WaitNode *node = S->freenodes;
+    if (node == NULL) {
+        int i;
+        lua_State *L = t->L != NULL ? t->L : S->main->L;
+        node = (lsc_WaitNode*)lua_newuserdata(L,
+                sizeof(lsc_WaitNode) * LSC_NODE_BLOCK);
+        get_nodebox(L);
+        lua_insert(L, -2);
+        lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+        lua_pop(L, 1);
+        for (i = 0; i < LSC_NODE_BLOCK; ++i) {
+            node[i].next = S->freenodes;
+            S->freenodes = &node[i];
+        }
+        node = S->freenodes;
+    }
+    S->freenodes = node->next;
+    return node;
+}
+
+static void free_nodes(lsc_Task *t) {
+    lsc_WaitNode *node = t->nodes;
+    while (node != NULL) {
+        lsc_WaitNode *next = node->next;
+        queue_removeself(&node->head);
+        node->next = t->S->freenodes;
+        t->S->freenodes = node;
+        node = next;
+    }
+    t->nodes = NULL;
+}
+
+static lsc_Signal *task_node(lsc_Task *t, lsc_Signal *s) {
+    lsc_WaitNode *node;
+    if (t->nodes == NULL)
+        return t->waitat == s ? &t->head : NULL;
+    for (node = t->nodes; node != NULL; node = node->next)
+        if (node->waitat == s)
+            return &node->head;
+    return NULL;
+}
+
+static void fire_task(lsc_Task *t, lsc_Signal *s) {
+    lsc_WaitNode *node;
+    for (node = t->nodes; node != NULL; node = node->next)
+        if (node->waitat == s) {
+            t->fired = node->index;
+            return;
+        }
+}
+
+static void cancel_wait(lsc_Task *t) {
+    timer_remove(t->S, &t->timer);
+    if (t->nodes != NULL)
+        free_nodes(t);
+}
+
+static int queue_task(lsc_Task *t, lsc_Signal *s) {
+    cancel_wait(t);
+    queue_append(&t->head, t->waitat = s);
+    return 1;
+}
+
+LSC_API lsc_Signal *lsc_newsignal(lua_State *L, size_t extrasz) {
+    lsc_Signal *s =
+        (lsc_Signal*)lua_newuserdata(L, sizeof(lsc_Signal) + extrasz);
+    luaL_setmetatable(L, "sched.signal");
+    lsc_initsignal(s);
+    return s;
+}
+
+LSC_API void lsc_deletesignal(lsc_Signal *s, lua_State *from) {
+    lsc_Signal removed;
+    lsc_Task *t = NULL;
+    /* replace and invalid signal */
+    if (lsc_signalvalid(s) && (t = lsc_next(s, NULL)) != NULL)
+        cursor_reset(t->S, s);
+    queue_replace(&removed, s);
+    while ((t = lsc_next(&removed, NULL)) != NULL) {
+        lua_State *L = task_state(t);
+        fire_task(t, s);
+        lua_pushnil(L);
+        lua_pushstring(L, "signal deleted");
+        lsc_wakeup(t, from, 2);
+        assert(t->waitat != &removed);
+    }
+}
+
+LSC_API void lsc_initsignal(lsc_Signal *s) {
+    s->prev = s->next = s;
+}
+
+LSC_API int lsc_signalvalid(lsc_Signal *s) {
+    return s->prev != NULL;
+}
+
+LSC_API lsc_Task *lsc_next(lsc_Signal *s, lsc_Task *curr) {
+    lsc_Signal *head;
+    if (curr == NULL)
+        return s->prev == s ? NULL : node_task(s->next);
+    head = curr->nodes == NULL ? &curr->head : task_node(curr, s);
+    return head == NULL || head->next == s ?
+        NULL : node_task(head->next);
+}
+
+LSC_API size_t lsc_count(lsc_Signal *s) {
+    return queue_count(s);
+}
+
+LSC_API lsc_Task *lsc_index(lsc_Signal *s, int idx) {
+    lsc_Signal *node = s->next;
+    lsc_State *S;
+    size_t i = 0, n = queue_count(s);
+    size_t pos = idx >= 0 ? (size_t)idx : n - (size_t)-idx;
+    if (idx >= 0 ? pos >= n : (size_t)-idx > n)
+        return NULL; /* also handle deleted signal (count == 0) */
+    S = node_task(node)->S;
+    if (n - 1 - pos < pos) /* walk from tail */
+        node = s->prev, i = n - 1;
+    if (S->cursorq == s && (S->cursoridx > pos ?
+                S->cursoridx - pos : pos - S->cursoridx)
+            < (i > pos ? i - pos : pos - i))
+        node = S->cursor, i = S->cursoridx;
+    for (; i < pos; ++i) node = node->next;
+    for (; i > pos; --i) node = node->prev;
+    S->cursorq = s;
+    S->cursor = node;
+    S->cursoridx = pos;
+    return node_task(node);
+}
+
+/* task maintains */
+
+#ifdef LSC_USE_STATS
+static void stats_unlink(lsc_Task *t) {
+    if (t->prevtask != NULL)
+        t->prevtask->nexttask = t->nexttask;
+    else if (t->S->tasks == t)
+        t->S->tasks = t->nexttask;
+    else
+        return; /* not in list */
+    if (t->nexttask != NULL)
+        t->nexttask->prevtask = t->prevtask;
+    t->prevtask = t->nexttask = NULL;
+}
+#endif
+
+#ifdef LSC_LAZY_TASK
+static void bind_thread(lua_State *L, lsc_Task *t, int bind) {
+    /* map coroutine of t to t (or nothing), for `lsc_current` */
+#ifdef LSC_USE_EXTRASPACE
+    (void)L;
+    thread_task(t->L) = bind ? t : NULL;
+#else
+    get_taskbox(L);
+    lua_pushthread(t->L);
+    if (t->L != L)
+        lua_xmove(t->L, L, 1); /* push thread */
+    if (bind)
+        lua_pushlightuserdata(L, t);
+    else
+        lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+#endif
+}
+
+static void register_task(lua_State *L, lsc_Task *t) {
+    /* stack: task object */
+    lua_pushthread(t->L);
+    if (t->L != L)
+        lua_xmove(t->L, L, 1); /* push thread */
+    lua_setuservalue(L, -2); /* task object anchors thread */
+    lua_pushvalue(L, -1);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    bind_thread(L, t, 1);
+}
+
+static void release_task(lsc_Task *t) {
+    /* finished task is collectable when nobody else refers it, but
+     * still found by `lsc_pushtask` until then */
+    lua_State *L = t->L;
+    get_weakbox(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+    lua_rawsetp(L, -2, t);
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+    t->ref = LUA_NOREF;
+}
+
+static void unregister_task(lsc_Task *t) {
+    lua_State *L = t->L != NULL ? t->L : t->S->main->L;
+    if (t->ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+        lua_pushnil(L);
+        lua_setuservalue(L, -2);
+        lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, t->ref);
+        t->ref = LUA_NOREF;
+    } else { /* finished, released by `release_task` */
+        get_weakbox(L);
+        lua_pushnil(L);
+        lua_rawsetp(L, -2, t);
+        lua_pop(L, 1);
+    }
+    if (t->L != NULL)
+        bind_thread(L, t, 0);
+    t->lazy = 0;
+}
+#else
+# define release_task(t) ((void)0)
+
+static void register_task(lua_State *L, lsc_Task *t) {
+    /* stack: task object */
+    get_taskbox(L);
+    lua_pushthread(t->L);
+    if (t->L != L)
+        lua_xmove(t->L, L, 1); /* push thread */
+    lua_pushvalue(L, -3); /* task object */
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+static void unregister_task(lsc_Task *t) {
+    get_taskbox(t->L);
+    lua_pushthread(t->L);
+    lua_pushnil(t->L);
+    lua_rawset(t->L, -3);
+    lua_pop(t->L, 1);
+}
+#endif
+
+static lua_State *pool_thread(lua_State *L, lsc_State *S) {
+    lua_State *co;
+    if (S->npool == 0) {
+        ++S->poolmisses;
+        return lua_newthread(L);
+    }
+    ++S->poolhits;
+    get_poolbox(L);
+    lua_rawgeti(L, -1, S->npool);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, S->npool--);
+    lua_remove(L, -2);
+    co = lua_tothread(L, -1);
+    assert(co != NULL && lua_gettop(co) == 0);
+    return co;
+}
+
+static void pool_recycle(lsc_Task *t, lua_State *from) {
+    lua_State *L = t->L;
+    lsc_State *S = t->S;
+    if (!t->spawned || S->npool >= S->poollimit)
+        return;
+#if LUA_VERSION_NUM >= 504
+    if (lua54_closethread(L, from) != LUA_OK)
+        return;
+#else
+    if (lua_status(L) != LUA_OK)
+        return; /* yielded or errored coroutine can not reused */
+#endif
+    lua_settop(L, 0);
+    get_poolbox(L);
+    lua_pushthread(L);
+    lua_rawseti(L, -2, ++S->npool);
+    lua_pop(L, 1);
+}
+
+LSC_API void lsc_setpoollimit(lua_State *L, int limit) {
+    lsc_State *S = lsc_state(L);
+    S->poollimit = limit < 0 ? 0 : limit;
+    if (S->npool <= S->poollimit)
+        return;
+    get_poolbox(L);
+    while (S->npool > S->poollimit) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, S->npool--);
+    }
+    lua_pop(L, 1);
+}
+
+#ifdef LSC_LAZY_TASK
+static lua_State *task_state(lsc_Task *t) {
+    /* make coroutine for unstarted task */
+    int i, n = t->lazy;
+    lua_State *L = t->S->main->L, *co;
+    if (n == 0)
+        return t->L;
+    luaL_checkstack(L, n + 3, "too many args");
+    co = t->spawned ? pool_thread(L, t->S) : lua_newthread(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, -3);
+    lua_setuservalue(L, -3); /* task object anchors thread now */
+    if (n == 1) /* the function itself */
+        lua_xmove(L, co, 1);
+    else {
+        for (i = 1; i <= n; ++i)
+            lua_rawgeti(L, -i, i);
+        lua_xmove(L, co, n);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    t->L = co;
+    t->lazy = 0;
+    bind_thread(L, t, 1);
+    return co;
+}
+
+static int lazy_context(lua_State *L, lsc_Task *t, int skip) {
+    int i, idx, n = t->lazy;
+    luaL_checkstack(L, n + 1, "too many args");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+    lua_getuservalue(L, -1);
+    lua_remove(L, -2);
+    if (n == 1) {
+        if (skip) lua_pop(L, 1);
+        return !skip;
+    }
+    idx = lua_gettop(L);
+    for (i = skip ? 2 : 1; i <= n; ++i)
+        lua_rawgeti(L, idx, i);
+    lua_remove(L, idx);
+    return skip ? n - 1 : n;
+}
+#endif
+
+LSC_API lsc_Task *lsc_newtask(lua_State *L, lua_State *coro, size_t extrasz) {
+    lsc_Task *t = (lsc_Task*)lua_newuserdata(L, sizeof(lsc_Task) + extrasz);
     luaL_setmetatable(L, "sched.task");
     t->S = lsc_state(L);
     t->L = coro;
     t->waitat = NULL;
-    lsc_initsignal(&t->head);
+    t->self = t;
+    t->nodes = NULL;
+    t->fired = -1;
+    t->ref = LUA_NOREF;
+    t->spawned = 0;
+    t->lazy = 0;
+    t->priority = LSC_DEFAULT_PRIORITY;
+    node_init(&t->head);
     lsc_initsignal(&t->joined);
-    register_task(L, t);
+    timer_init(&t->timer);
+#ifdef LSC_USE_STATS
+    memset(&t->stats, 0, sizeof(lsc_TaskStats));
+    t->since = clock_ns();
+    t->prevtask = NULL;
+    if ((t->nexttask = t->S->tasks) != NULL)
+        t->nexttask->prevtask = t;
+    t->S->tasks = t;
+#endif
+    if (coro != NULL)
+        register_task(L, t);
+    return t;
+}
+
+static lsc_Task *spawn_task(lua_State *L, int nargs, int pooled) {
+#ifdef LSC_LAZY_TASK
+    lsc_Task *t;
+    if (nargs > 0) { /* pack function and arguments */
+        int i, pack;
+        lua_createtable(L, nargs + 1, 0);
+        lua_insert(L, -nargs-2);
+        pack = lua_gettop(L) - nargs - 1;
+        for (i = nargs + 1; i >= 1; --i)
+            lua_rawseti(L, pack, i);
+    }
+    t = lsc_newtask(L, NULL, 0);
+    lua_insert(L, -2);
+    lua_setuservalue(L, -2);
+    lua_pushvalue(L, -1);
+    t->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    t->lazy = nargs + 1;
+#else
+    lua_State *coro = pooled ? pool_thread(L, lsc_state(L))
+                             : lua_newthread(L);
+    lsc_Task *t = lsc_newtask(L, coro, 0);
+    lua_insert(L, -nargs-3);
+    lua_pop(L, 1); /* remove coroutine */
+    lua_xmove(L, coro, nargs + 1);
+#endif
+    t->spawned = pooled;
+    lsc_ready(t, 0);
+    return t;
+}
+
+LSC_API lsc_Task *lsc_spawn(lua_State *L, int nargs)
+{ return spawn_task(L, nargs, 1); }
+
+static void wakeup_joins(lsc_Task *t, lua_State *from) {
+    lsc_Signal joined;
+    int nrets = 2, stat = t->L != NULL ? lua_status(t->L) : LUA_OK;
+    if (from == NULL)
+        from = task_state(t);
+    /* replace and invalid joined queue */
+    t->waitat = NULL;
+    t->fired = -1;
+    cancel_wait(t);
+    queue_removeself(&t->head);
+    node_init(&t->head);
+    if (!lsc_signalvalid(&t->joined))
+        return;
+    cursor_reset(t->S, &t->joined);
+    queue_replace(&joined, &t->joined);
+    /* calc return values */
+    switch (stat) {
+    case LUA_YIELD:
+        lua_pushnil(from);
+        lua_pushstring(from, "task deleted");
+        nrets += lsc_getcontext(from, t);
+        break;
+    case LUA_OK:
+        lua_pushboolean(from, 1);
+        nrets += lsc_getcontext(from, t) - 1;
+        break;
+    default:
+        lua_pushnil(from);
+        lua_pushvalue(t->L, 1);
+        if (t->L != from)
+            lua_xmove(t->L, from, 1);
+        break;
+    }
+    /* setup return values */
+    lsc_emit(&joined, from, nrets);
+    assert(joined.prev == &joined);
+}
+
+LSC_API int lsc_deletetask(lsc_Task *t, lua_State *from) {
+    lsc_Status s = lsc_status(t);
+    if (s == lsc_Dead || s == lsc_Running)
+        return 0;
+    /* invalid task and wake up joined tasks */
+    wakeup_joins(t, from);
+    /* give back coroutine to pool and remove it from task box */
+    if (t->L != NULL)
+        pool_recycle(t, from);
+    unregister_task(t);
+#ifdef LSC_USE_STATS
+    stats_unlink(t);
+#endif
+    /* mark task as dead */
+    t->L = NULL;
+    return 1;
+}
+
+static int copy_stack(lua_State *from, lua_State *to, int n) {
+    int i;
+    luaL_checkstack(from, n, "too many args");
+    for (i = 0; i < n; ++i)
+        lua_pushvalue(from, -n);
+    if (from != to)
+        lua_xmove(from, to, n);
+    return n;
+}
+
+LSC_API int lsc_setcontext(lua_State *L, lsc_Task *t, int nargs) {
+    lsc_Status s = lsc_status(t);
+    if (s <= 0) return 0;
+    if (lua_status(task_state(t)) == LUA_OK) { /* initial task? */
+        int n = lua_tointeger(t->L, 1);
+        lua_settop(t->L, n == 0 ? 1 : n);
+    } else
+        lua_settop(t->L, 0);
+    return copy_stack(L, t->L, nargs);
+}
+
+LSC_API int lsc_getcontext(lua_State *L, lsc_Task *t) {
+    lsc_Status s = lsc_status(t);
+    if (s == lsc_Dead || s == lsc_Running)
+        return 0;
+    if (s == lsc_Error) {
+        assert(lua_isstring(t->L, -1));
+        lua_pushvalue(t->L, -1);
+        lua_xmove(t->L, L, 1);
+        return 1;
+    }
+#ifdef LSC_LAZY_TASK
+    if (t->L == NULL) /* unstarted task */
+        return lazy_context(L, t, s > 0);
+#endif
+    if (s > 0 && lua_status(t->L) == LUA_OK) { /* initial task? */
+        int n = lua_tointeger(t->L, 1);
+        return copy_stack(t->L, L,
+                lua_gettop(t->L) - (n == 0 ? 1 : n));
+    }
+    return copy_stack(t->L, L, lua_gettop(t->L));
+}
+
+LSC_API lsc_Status lsc_status(lsc_Task *t) {
+    if (t->L == NULL && t->lazy == 0)
+        return lsc_Dead;
+    else if (t->waitat == &t->S->running)
+        return lsc_Running;
+    else if (t->waitat == &t->S->ready[t->priority]
+            || t->waitat == &t->S->deferred)
+        return lsc_Ready;
+    else if (t->waitat == &t->S->error)
+        return lsc_Error;
+    else if (!lsc_signalvalid(&t->joined))
+        return lsc_Finished;
+    else if (t->waitat == NULL)
+        return lsc_Hold;
+    return lsc_Waitting;
+}
+
+#ifdef LSC_USE_STATS
+static int latency_bucket(unsigned long us) {
+    int m = 2, idx;
+    if (us < 4) return (int)us;
+    while ((us >> (m + 1)) != 0) ++m; /* m is the highest bit */
+    idx = (m - 1) * 4 + (int)((us >> (m - 2)) & 3);
+    return idx < LSC_LATENCY_BUCKETS ? idx : LSC_LATENCY_BUCKETS - 1;
+}
+
+static void stats_account(lsc_Task *t, lsc_Clock now) {
+    /* time since last status changed goes to ready or wait */
+    double d = (double)(now - t->since) / 1e9;
+    if (lsc_status(t) == lsc_Ready) {
+        lsc_Metrics *m = &t->S->metrics;
+        t->stats.ready += d;
+        m->latencysum += d;
+        ++m->latency[latency_bucket((unsigned long)((now - t->since) / 1000))];
+    }
+    else
+        t->stats.wait += d;
+    t->since = now;
+}
+
+static void stats_resumed(lsc_Task *t, lsc_Clock start, double nested) {
+    /* tasks waked up inside this resume count their time themselves */
+    lsc_Clock now = clock_ns();
+    double total = (double)(now - start) / 1e9;
+    double slice = total - (t->S->resumed - nested);
+    t->S->resumed = nested + total;
+    ++t->stats.resumes;
+    t->stats.cpu += slice;
+    if (slice > t->stats.maxslice)
+        t->stats.maxslice = slice;
+    t->since = now;
+}
+
+LSC_API void lsc_taskstats(lsc_Task *t, lsc_TaskStats *stats) {
+    lsc_Status s = lsc_status(t);
+    *stats = t->stats;
+    if (s == lsc_Ready || s == lsc_Waitting || s == lsc_Hold) {
+        double d = (double)(clock_ns() - t->since) / 1e9;
+        if (s == lsc_Ready)
+            stats->ready += d;
+        else
+            stats->wait += d;
+    }
+}
+
+LSC_API lsc_Task *lsc_nexttask(lsc_State *s, lsc_Task *curr) {
+    return curr == NULL ? s->tasks : curr->nexttask;
+}
+#endif
+
+LSC_API unsigned long lsc_latencybound(int idx) {
+    if (idx < 4) return (unsigned long)idx;
+    return (unsigned long)(4 + idx % 4) << (idx / 4 - 1);
+}
+
+LSC_API void lsc_metrics(lsc_State *s, lsc_Metrics *m) {
+    int i;
+    *m = s->metrics;
+    m->uptime = (double)(lsc_Time)(lsc_now() - s->born) / 1000;
+    m->ready = 0;
+    for (i = 0; i < LSC_PRIORITIES; ++i)
+        m->ready += queue_count(&s->ready[i]) + queue_count(&s->batch[i]);
+    m->errors = queue_count(&s->error);
+}
+
+static void add_number(luaL_Buffer *b, const char *prefix, double value,
+                       const char *suffix) {
+    char buff[64];
+    sprintf(buff, "%.14g", value);
+    luaL_addstring(b, prefix);
+    luaL_addstring(b, buff);
+    luaL_addstring(b, suffix);
+}
+
+static void add_metric(luaL_Buffer *b, const char *name, const char *type,
+                       const char *help, double value) {
+    lua_pushfstring(b->L, "# HELP lsched_%s %s\n# TYPE lsched_%s %s\n"
+            "lsched_%s ", name, help, name, type, name);
+    luaL_addvalue(b);
+    add_number(b, "", value, "\n");
+}
+
+LSC_API const char *lsc_pushprometheus(lua_State *L, const lsc_Metrics *m) {
+#ifdef LSC_USE_STATS
+    const char *name = "lsched_ready_latency_seconds";
+    double count = 0;
+    int i;
+#endif
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    add_metric(&b, "ticks_total", "counter",
+            "Scheduler ticks run.", (double)m->ticks);
+    add_metric(&b, "dispatched_total", "counter",
+            "Tasks run from ready queues.", (double)m->dispatched);
+    add_metric(&b, "run_seconds_total", "counter",
+            "Seconds spent running ready tasks.", m->runtime);
+    add_metric(&b, "poll_seconds_total", "counter",
+            "Seconds spent in poll function.", m->polltime);
+    add_metric(&b, "uptime_seconds", "gauge",
+            "Seconds since scheduler created.", m->uptime);
+    add_metric(&b, "ready_tasks", "gauge",
+            "Tasks on ready queues.", (double)m->ready);
+    add_metric(&b, "error_tasks", "gauge",
+            "Tasks errored and not collected.", (double)m->errors);
+#ifdef LSC_USE_STATS
+    lua_pushfstring(L, "# HELP %s Latency from task ready to run.\n"
+            "# TYPE %s histogram\n", name, name);
+    luaL_addvalue(&b);
+    for (i = 0; i < LSC_LATENCY_BUCKETS - 1; ++i) {
+        count += (double)m->latency[i];
+        luaL_addstring(&b, name);
+        add_number(&b, "_bucket{le=\"",
+                (double)lsc_latencybound(i + 1) / 1e6, "\"} ");
+        add_number(&b, "", count, "\n");
+    }
+    count += (double)m->latency[i];
+    luaL_addstring(&b, name);
+    add_number(&b, "_bucket{le=\"+Inf\"} ", count, "\n");
+    luaL_addstring(&b, name);
+    add_number(&b, "_sum ", m->latencysum, "\n");
+    luaL_addstring(&b, name);
+    add_number(&b, "_count ", count, "\n");
+#endif
+    luaL_pushresult(&b);
+    return lua_tostring(L, -1);
+}
+
+LSC_API int lsc_error(lsc_Task *t, const char *errmsg) {
+    lsc_Status s = lsc_status(t);
+    if (s == lsc_Dead || s == lsc_Finished) return 0;
+    if (s == lsc_Running) return luaL_error(t->L, errmsg);
+    lua_settop(task_state(t), 0);
+    lua_pushstring(t->L, errmsg); /* context */
+    t->fired = -1;
+    return queue_task(t, &t->S->error);
+}
+
+static void wait_signal(lsc_Task *t, lsc_Signal *s) {
+    trace_event(t->S, TRACE_WAIT, t, s);
+    cancel_wait(t);
+    t->fired = -1;
+    t->waitat = s;
+    if (s == NULL) {
+        queue_removeself(&t->head);
+        node_init(&t->head);
+    }
+    else
+        queue_append(&t->head, t->waitat);
+}
+
+LSC_API int lsc_wait(lsc_Task *t, lsc_Signal *s, int nctx) {
+    lsc_Status stat = lsc_status(t);
+    wait_signal(t, s);
+    if (stat == lsc_Running)
+        return lua_yield(t->L, nctx);
+    return 0;
+}
+
+LSC_API int lsc_waitfor(lsc_Task *t, lsc_Signal *s, lsc_Time deadline, int nctx) {
+    lsc_Status stat = lsc_status(t);
+    if (stat < 0) return 0;
+    wait_signal(t, s);
+    timer_insert(t->S, &t->timer, deadline);
+    if (stat == lsc_Running)
+        return lua_yield(t->L, nctx);
+    return 0;
+}
+
+static void wait_any(lsc_Task *t, lsc_Signal **signals, int n) {
+    lsc_WaitNode **pnode = &t->nodes;
+    int i;
+    wait_signal(t, NULL);
+    for (i = 0; i < n; ++i) {
+        lsc_WaitNode *node;
+        for (node = t->nodes; node != NULL; node = node->next)
+            if (node->waitat == signals[i])
+                break;
+        if (node != NULL) continue; /* duplicated signal */
+        node = new_node(t);
+        node->task = t;
+        node->waitat = signals[i];
+        node->next = NULL;
+        node->index = i + 1;
+        node_init(&node->head);
+        queue_append(&node->head, signals[i]);
+        *pnode = node;
+        pnode = &node->next;
+    }
+    if (t->nodes != NULL) {
+        t->waitat = t->nodes->waitat;
+        t->fired = 0;
+    }
+}
+
+LSC_API int lsc_waitany(lsc_Task *t, lsc_Signal **signals, int n, int nctx) {
+    lsc_Status stat = lsc_status(t);
+    if (stat < 0) return 0;
+    wait_any(t, signals, n);
+    if (stat == lsc_Running)
+        return lua_yield(t->L, nctx);
+    return 0;
+}
+
+LSC_API int lsc_ready(lsc_Task *t, int nctx) {
+    if (lsc_status(t) == lsc_Running)
+        return 0;
+#ifdef LSC_USE_STATS
+    stats_account(t, clock_ns());
+#endif
+    trace_event(t->S, TRACE_READY, t, NULL);
+    return queue_task(t, &t->S->ready[t->priority]);
+}
+
+LSC_API int lsc_setpriority(lsc_Task *t, int prio) {
+    int old = t->priority;
+    lsc_Status s = lsc_status(t);
+    if (prio < 0) prio = 0;
+    if (prio >= LSC_PRIORITIES) prio = LSC_PRIORITIES - 1;
+    t->priority = prio;
+    if (s == lsc_Ready && old != prio)
+        queue_task(t, &t->S->ready[prio]);
+    return old;
+}
+
+LSC_API int lsc_setquota(lsc_State *s, int prio, int quota) {
+    int old;
+    if (prio < 0 || prio >= LSC_PRIORITIES)
+        return 0;
+    old = s->quota[prio];
+    s->quota[prio] = quota < 0 ? 0 : quota;
+    return old;
+}
+
+LSC_API int lsc_hold(lsc_Task *t, int nctx) {
+    if (lsc_status(t) == lsc_Running)
+        return 0;
+    wait_signal(t, NULL);
+    return 1;
+}
+
+LSC_API int lsc_join(lsc_Task *t, lsc_Task *jointo, int nctx) {
+    lsc_Status st = lsc_status(t);
+    lsc_Status sj = lsc_status(jointo);
+    if (st == lsc_Running || sj <= 0) return 0;
+    t->fired = -1;
+    return queue_task(t, &jointo->joined);
+}
+
+static void adjust_stack(lua_State *L, int top, int nargs) {
+    /* may faster than lua_remove? */
+    if (top > nargs) {
+        int i, removed = top - nargs;
+        for (i = 1; i <= removed; ++i) {
+            lua_pushvalue(L, removed+i);
+            lua_replace(L, i);
+        }
+        lua_settop(L, nargs);
+    }
+}
+
+static int defer_wakeup(lsc_Task *t, int nargs) {
+    /* queue a nested wakeup, the stack is trimmed to args, so it can
+     * be resumed with all stack values just like ready tasks */
+    lua_State *L = task_state(t);
+    int top = lua_gettop(L), first = lua_status(L) == LUA_OK;
+    if (nargs >= 0 && nargs != top - first) {
+        if (first || nargs > top) return 0; /* can not defer */
+        while (top-- > nargs)
+            lua_remove(L, 1);
+    }
+#ifdef LSC_USE_STATS
+    stats_account(t, clock_ns());
+#endif
+    trace_event(t->S, TRACE_READY, t, NULL);
+    return queue_task(t, &t->S->deferred);
+}
+
+static void drain_deferred(lsc_State *S, lua_State *from) {
+    lsc_Task *t;
+    S->draining = 1;
+    while ((t = lsc_next(&S->deferred, NULL)) != NULL)
+        lsc_wakeup(t, from, -1);
+    S->draining = 0;
+}
+
+static int resume_task(lsc_Task *t, lua_State *from, int nargs) {
+    int res, top;
+#ifdef LSC_USE_STATS
+    lsc_Clock start;
+    double nested;
+
+    stats_account(t, start = clock_ns());
+    nested = t->S->resumed;
+#endif
+    (void)task_state(t); /* make coroutine for unstarted task */
+    trace_event(t->S, TRACE_RESUME, t, trace_current(t->S));
+    queue_task(t, &t->S->running);
+    res = lua_status(t->L);
+    top = lua_gettop(t->L);
+    if (nargs < 0) { /* nargs defaults all stack values */
+        nargs = top;
+        if (res == LUA_OK)
+            --nargs; /* first run */
+    }
+    t->S->fired = t->fired;
+    if (t->fired >= 0) { /* waked up from lsc_waitany */
+        if (t->fired == 0)
+            lua_pushnil(t->L);
+        else
+            lua_pushinteger(t->L, t->fired);
+        lua_insert(t->L, -nargs-1);
+        ++nargs, ++top;
+        t->fired = -1;
+    }
+    /* adjust stack to contain args only */
+    if (res != LUA_OK && res != LUA_YIELD)
+        adjust_stack(t->L, nargs, top);
+    if (t->S->profile != NULL)
+        res = prof_resume(t, from, nargs);
+    else {
+        if (lua_gethook(t->L) == prof_hook) /* created while profiling */
+            lua_sethook(t->L, NULL, 0, 0);
+        res = lua_resume(t->L, from, nargs);
+    }
+#ifdef LSC_USE_STATS
+    stats_resumed(t, start, nested);
+#endif
+    trace_event(t->S, TRACE_RESUMEEND, t, NULL);
+    if (res == LUA_OK || res != LUA_YIELD) {
+        /* invaliad task and call joined tasks */
+        wakeup_joins(t, from);
+        if (res != LUA_OK) {
+            /* setup error message as context */
+            const char *errmsg = lua_tostring(t->L, -1);
+            assert(errmsg != NULL);
+            lua_settop(t->L, 0);
+            lua_pushstring(t->L, errmsg);
+            queue_task(t, &t->S->error);
+            return 0;
+        }
+#ifdef LSC_USE_STATS
+        stats_unlink(t); /* finished, not interesting anymore */
+#endif
+        /* nothing to retrieve, give back coroutine at once */
+        if (t->spawned && lua_gettop(t->L) == 0)
+            lsc_deletetask(t, from);
+        else
+            release_task(t);
+    }
+    /* finished or wait something? */
+    assert(lsc_status(t) != lsc_Running);
+    return 1;
+}
+
+LSC_API int lsc_wakeup(lsc_Task *t, lua_State *from, int nargs) {
+    lsc_State *S = t->S;
+    int res;
+    if (lsc_status(t) <= 0) return 0;
+    if (S->depth != 0 && S->trampoline && defer_wakeup(t, nargs))
+        return 1;
+    ++S->depth;
+    res = resume_task(t, from, nargs);
+    --S->depth;
+    if (S->depth == 0 && !S->draining && S->deferred.next != &S->deferred)
+        drain_deferred(S, from);
+    return res;
+}
+
+static void broadcast_args(lua_State *from, lsc_Task *t, int nargs) {
+    /* lsc_setcontext for emit: t is known waiting, and the stack
+     * space of from is checked once by caller */
+    lua_State *L = task_state(t);
+    int i;
+    if (lua_status(L) == LUA_OK) { /* initial task? */
+        int n = (int)lua_tointeger(L, 1);
+        lua_settop(L, n == 0 ? 1 : n);
+    } else
+        lua_settop(L, 0);
+    luaL_checkstack(L, nargs + 1, "too many args"); /* +1 for waitany */
+    for (i = 0; i < nargs; ++i)
+        lua_pushvalue(from, -nargs);
+    lua_xmove(from, L, nargs);
+}
+
+LSC_API int lsc_emit(lsc_Signal *s, lua_State *from, int nargs) {
+    int n = 0;
+    lsc_Task *t;
+    lsc_State *S = NULL;
+    lsc_Signal *node, wait_again;
+    if ((t = lsc_next(s, NULL)) != NULL) {
+        S = t->S;
+        trace_event(S, TRACE_EMIT, trace_current(S), s);
+    }
+    if (t != NULL && from && nargs > 0) /* args pack shared by waiters */
+        luaL_checkstack(from, nargs, "too many args");
+    lsc_initsignal(&wait_again);
+    while ((t = lsc_next(s, NULL)) != NULL) {
+        assert(lsc_status(t) != lsc_Running);
+        fire_task(t, s);
+        if (from && nargs > 0)
+            broadcast_args(from, t, nargs);
+        lsc_wakeup(t, from, nargs);
+        if ((node = task_node(t, s)) != NULL)
+            queue_append(node, &wait_again);
+        ++n;
+    }
+    if (S != NULL) /* waked up tasks may index s */
+        cursor_reset(S, s);
+    queue_replace(s, &wait_again);
+    if (from && nargs > 0)
+        lua_pop(from, nargs);
+    return n;
+}
+
+static int move_tasks(lsc_Signal *s, lsc_Signal *to, int ready,
+                      lua_State *from, int nctx) {
+    /* move tasks on s to `to` (to their ready queues if ready is set,
+     * or hold them if to is NULL). waitany nodes are replaced by task
+     * heads in place, and the remain chain is spliced to at end.
+     * nctx values at from are set as context if nctx >= 0 */
+    lsc_Signal *node, *next;
+    int n = 0, spliced = 0;
+#ifdef LSC_USE_STATS
+    lsc_Clock now = clock_ns();
+#endif
+    if (!lsc_signalvalid(s) || s->next == s || s == to
+            || (to != NULL && !lsc_signalvalid(to)))
+        return 0;
+    cursor_reset(node_task(s->next)->S, s);
+    if (ready) {
+        lsc_Task *t = node_task(s->next);
+        to = &t->S->ready[t->priority];
+    }
+    for (node = s->next; node != s; node = next, ++n) {
+        lsc_Task *t = node_task(node);
+        lsc_Signal *q = ready ? &t->S->ready[t->priority] : to;
+        next = node->next;
+        if (node != &t->head) { /* waitany node */
+            t->head.prev = node->prev;
+            t->head.next = next;
+            node->prev->next = next->prev = &t->head;
+            node_owner(&t->head) = node_owner(node);
+            node_count(&t->head) = node_count(node);
+            node_init(node);
+            node = &t->head;
+            fire_task(t, s);
+        }
+        cancel_wait(t);
+        if (nctx >= 0)
+            broadcast_args(from, t, nctx);
+        if (ready) {
+#ifdef LSC_USE_STATS
+            stats_account(t, now);
+#endif
+            trace_event(t->S, TRACE_READY, t, NULL);
+        } else {
+            trace_event(t->S, TRACE_WAIT, t, to);
+            t->fired = -1;
+        }
+        t->waitat = q;
+        if (q == to && q != NULL) {
+            node_owner(node) = q;
+            ++spliced;
+            continue;
+        }
+        node->prev->next = next; /* not the common target */
+        next->prev = node->prev;
+        node_init(node);
+        if (q != NULL) queue_append(node, q);
+    }
+    if (spliced != 0) {
+        if (to->next == to)
+            node_count(s->next) = spliced;
+        else
+            node_count(to->next) += spliced;
+        s->next->prev = to->prev;
+        to->prev->next = s->next;
+        s->prev->next = to;
+        to->prev = s->prev;
+    }
+    lsc_initsignal(s);
+    return n;
+}
+
+LSC_API int lsc_readyall(lsc_Signal *s) {
+    return move_tasks(s, NULL, 1, NULL, -1);
+}
+
+LSC_API int lsc_holdall(lsc_Signal *s) {
+    return move_tasks(s, NULL, 0, NULL, -1);
+}
+
+LSC_API int lsc_moveall(lsc_Signal *from, lsc_Signal *to) {
+    return to == NULL ? 0 : move_tasks(from, to, 0, NULL, -1);
+}
+
+
+/* main state maintains */
+
+LSC_API lsc_Task *lsc_current(lua_State *L) {
+#ifdef LSC_USE_EXTRASPACE
+    lsc_Task *t = thread_task(L);
+    return t != NULL && t->L == L ? t : NULL;
+#else
+    lsc_Task *t = NULL;
+    lsc_State *S;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_MAIN_STATE);
+    S = (lsc_State*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    /* the running task is at the end of running queue, it's asked
+     * mostly, so try it before the lookup by thread */
+    if (S != NULL && (t = trace_current(S)) != NULL && t->L == L)
+        return t;
+    get_taskbox(L);
+    lua_pushthread(L);
+    lua_rawget(L, -2);
+    t = (lsc_Task*)lua_touserdata(L, -1);
+    lua_pop(L, 2);
+    return t;
+#endif
+}
+
+LSC_API lsc_Task *lsc_maintask(lua_State *L) {
+    lua_State *mL;
+    lsc_State *s = lsc_state(L);
+    if (s->main) return s->main;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    mL = lua_tothread(L, -1);
+    assert(mL != NULL);
+    s->main = lsc_newtask(L, mL, 0);
+    lua_pop(L, 2);
+    /* main task is always treats as running */
+    queue_task(s->main, &s->running);
+    return s->main;
+}
+
+LSC_API const char *lsc_collect(lua_State *L, lsc_State *s, lsc_Collect *f, void *ud) {
+    lsc_Signal curr_error;
+    luaL_Buffer b;
+    lsc_Task *t;
+    luaL_buffinit(L, &b);
+    cursor_reset(s, &s->error);
+    queue_replace(&curr_error, &s->error);
+    lsc_initsignal(&s->error);
+    while ((t = lsc_next(&curr_error, NULL)) != NULL) {
+        lua_pushfstring(L, "task(%p): ", t);
+        luaL_addvalue(&b);
+        if (f != NULL && f(t, L, ud))
+            luaL_addvalue(&b);
+        else {
+            assert(lua_isstring(t->L, -1));
+            lua_xmove(t->L, L, 1);
+            luaL_addvalue(&b);
+            lsc_deletetask(t, L);
+        }
+        if (t->L != NULL)
+            queue_append(&t->head, &s->error);
+        luaL_addchar(&b, '\n');
+    }
+    luaL_pushresult(&b);
+    return lua_tostring(L, -1);
+}
+
+LSC_API void lsc_setpoll(lsc_State *s, lsc_Poll *poll, void *ud) {
+    s->poll = poll;
+    s->ud = ud;
+}
+
+LSC_API int lsc_nexttimeout(lsc_State *s) {
+    int i;
+    if (s->error.prev != &s->error)
+        return 0;
+    for (i = 0; i < LSC_PRIORITIES; ++i)
+        if (queue_count(&s->ready[i]) != 0 || queue_count(&s->batch[i]) != 0)
+            return 0;
+    return next_timeout(s);
+}
+
+LSC_API unsigned long lsc_setspin(lsc_State *s, unsigned long max_ns) {
+    unsigned long old = s->spin;
+    s->spin = max_ns;
+    return old;
+}
+
+LSC_API int lsc_settrampoline(lsc_State *s, int enable) {
+    int old = s->trampoline;
+    s->trampoline = enable != 0;
+    return old;
+}
+
+typedef struct tick_budget {
+    size_t tasks; /* tasks left, 0 for no limit */
+    lsc_Clock ns, start;
+} tick_budget;
+
+static int run_batch(lsc_State *s, int prio, lua_State *from,
+                     tick_budget *b) {
+    lsc_Signal *batch = &s->batch[prio];
+    int n = s->quota[prio];
+    lsc_Task *t;
+    if (queue_count(batch) == 0) { /* start a new batch */
+        cursor_reset(s, batch);
+        cursor_reset(s, &s->ready[prio]);
+        queue_replace(batch, &s->ready[prio]);
+        lsc_initsignal(&s->ready[prio]);
+    }
+    while ((t = lsc_next(batch, NULL)) != NULL) {
+        lsc_wakeup(t, from, -1);
+        ++s->metrics.dispatched;
+        assert(node_owner(&t->head) != batch);
+        if (b->tasks != 0 && --b->tasks == 0)
+            return 0;
+        if (b->ns != 0 && clock_ns() - b->start >= b->ns)
+            return 0;
+        if (--n == 0) break;
+    }
+    return 1;
+}
+
+LSC_API int lsc_once(lsc_State *s, lua_State *from) {
+    return lsc_oncex(s, from, 0, 0);
+}
+
+LSC_API int lsc_oncex(lsc_State *s, lua_State *from,
+                      size_t max_tasks, lsc_Clock max_ns) {
+    int i, res = 0;
+    tick_budget b;
+    lsc_Clock start = clock_ns(), now;
+    ++s->metrics.ticks;
+    b.tasks = max_tasks;
+    b.ns = max_ns;
+    b.start = start;
+    if (s->ntimers != 0)
+        update_wheel(s, lsc_now());
+    for (i = 0; i < LSC_PRIORITIES; ++i)
+        if (!run_batch(s, i, from, &b)) break;
+    now = clock_ns();
+    s->metrics.runtime += (double)(now - start) / 1e9;
+    if (s->poll != NULL) {
+        trace_event(s, TRACE_POLL, NULL, NULL);
+        res = s->poll(s, from, s->ud);
+        trace_event(s, TRACE_POLLEND, NULL, NULL);
+        s->metrics.polltime += (double)(clock_ns() - now) / 1e9;
+    }
+    if (s->error.prev != &s->error) /* has errors? */
+        return -1;
+    for (i = 0; !res && i < LSC_PRIORITIES; ++i)
+        res = queue_count(&s->ready[i]) != 0 || queue_count(&s->batch[i]) != 0;
+    return res || s->ntimers != 0;
+}
+
+static void idle_wait(lsc_State *s) {
+    /* a poll function blocks itself, see `lsc_iopoll` */
+    int timeout;
+    if (s->poll == NULL && (timeout = lsc_nexttimeout(s)) > 0)
+        sleep_ms(timeout);
+}
+
+LSC_API int lsc_loop(lsc_State *s, lua_State *from) {
+    int res;
+    while ((res = lsc_once(s, from)) > 0)
+        idle_wait(s);
+    return res == 0;
+}
+
+
+/* epoll backend */
+
+#ifdef LSC_USE_EPOLL
+
+typedef struct io_fd io_fd;
+
+typedef struct io_state {
+    int epfd;
+    size_t nfds; /* registered fds, except the weak ones */
+    io_fd *weak; /* list of weak fds, see `io_weakfd` */
+    unsigned long spin; /* current spin window */
+    struct epoll_event events[LSC_IO_BATCH];
+} io_state;
+
+struct io_fd {
+    lsc_Signal read;
+    lsc_Signal write;
+    int ready; /* events arrived when no tasks waitting */
+    lsc_Poll *drain; /* not NULL for weak fd */
+    void *ud;
+    io_fd *nextweak;
+};
+
+static int io_gc(lua_State *L) {
+    io_state *io = (io_state*)lua_touserdata(L, 1);
+    if (io->epfd >= 0) {
+        close(io->epfd);
+        io->epfd = -1;
+    }
+    return 0;
+}
+
+static io_state *io_init(lua_State *L, lsc_State *S) {
+    io_state *io = (io_state*)S->io;
+    if (io != NULL) return io;
+    io = (io_state*)lua_newuserdata(L, sizeof(io_state));
+    io->epfd = -1;
+    io->nfds = 0;
+    io->weak = NULL;
+    io->spin = 0;
+    if (luaL_newmetatable(L, "sched.io")) {
+        lua_pushcfunction(L, io_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    if ((io->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_IO_STATE);
+    S->io = io;
+    if (S->poll == NULL)
+        lsc_setpoll(S, lsc_iopoll, NULL);
+    return io;
+}
+
+static io_fd *io_getfd(lua_State *L, io_state *io, int fd) {
+    struct epoll_event ev;
+    io_fd *f;
+    get_iobox(L);
+    if (lua53_rawgeti(L, -1, fd) == LUA_TUSERDATA) {
+        f = (io_fd*)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        return f;
+    }
+    lua_pop(L, 1);
+    f = (io_fd*)lua_newuserdata(L, sizeof(io_fd));
+    lsc_initsignal(&f->read);
+    lsc_initsignal(&f->write);
+    f->ready = 0;
+    f->drain = NULL;
+    /* register once for both directions, edge-triggered */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = f;
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        lua_pop(L, 2);
+        return NULL;
+    }
+    lua_rawseti(L, -2, fd);
+    lua_pop(L, 1);
+    ++io->nfds;
+    return f;
+}
+
+static void io_wakeup(io_fd *f, int event, int closed) {
+    lsc_Signal *s = event == LSC_IOWRITE ? &f->write : &f->read;
+    lsc_Task *t;
+    if (lsc_count(s) == 0 && !closed) {
+        f->ready |= event; /* remember it for next waitting */
+        return;
+    }
+    f->ready &= ~event;
+    while ((t = lsc_next(s, NULL)) != NULL) {
+        lua_State *L = task_state(t);
+        fire_task(t, s);
+        lsc_setcontext(L, t, 0); /* clean up context */
+        if (closed) {
+            lua_pushnil(L);
+            lua_pushstring(L, "closed");
+        }
+        else
+            lua_pushboolean(L, 1);
+        lsc_ready(t, lua_gettop(L));
+        assert(t->waitat != s);
+    }
+}
+
+LSC_API int lsc_waitfd(lsc_Task *t, int fd, int events, int nctx) {
+    lsc_Status stat = lsc_status(t);
+    lua_State *L;
+    io_state *io;
+    io_fd *f;
+    if (stat < 0) return 0;
+    L = task_state(t);
+    if ((io = io_init(L, t->S)) == NULL
+            || (f = io_getfd(L, io, fd)) == NULL)
+        return -1;
+    events = events == LSC_IOWRITE ? LSC_IOWRITE : LSC_IOREAD;
+    if ((f->ready & events) != 0) {
+        f->ready &= ~events;
+        return 1;
+    }
+    return lsc_wait(t, events == LSC_IOWRITE ? &f->write : &f->read, nctx);
+}
+
+#if defined(LSC_USE_CLUSTER) || defined(LSC_USE_OFFLOAD)
+static io_fd *io_weakfd(lua_State *L, lsc_State *S, int fd,
+                        lsc_Poll *drain, void *ud) {
+    /* a weak fd just wakes up poll, its events go to nobody, but
+     * drain is called in every poll instead, and returns non-zero if
+     * the loop should keep running for it */
+    io_state *io = io_init(L, S);
+    io_fd *f;
+    if (io == NULL || (f = io_getfd(L, io, fd)) == NULL)
+        return NULL;
+    f->drain = drain;
+    f->ud = ud;
+    f->nextweak = io->weak;
+    io->weak = f;
+    --io->nfds;
+    return f;
+}
+#endif
+
+static int io_drain(lsc_State *s, lua_State *from, io_state *io) {
+    io_fd *f, *next;
+    int alive = 0;
+    for (f = io->weak; f != NULL; f = next) {
+        next = f->nextweak; /* f may be closed in drain */
+        if (f->drain(s, from, f->ud))
+            alive = 1;
+    }
+    return alive;
+}
+
+LSC_API int lsc_closefd(lua_State *L, int fd) {
+    io_state *io = (io_state*)lsc_state(L)->io;
+    io_fd *f;
+    if (io == NULL) return 0;
+    get_iobox(L);
+    if (lua53_rawgeti(L, -1, fd) != LUA_TUSERDATA) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    f = (io_fd*)lua_touserdata(L, -1);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, fd);
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, fd, NULL); /* may closed already */
+    if (f->drain != NULL) {
+        io_fd **pf = &io->weak;
+        while (*pf != f) pf = &(*pf)->nextweak;
+        *pf = f->nextweak;
+    }
+    else
+        --io->nfds;
+    io_wakeup(f, LSC_IOREAD, 1);
+    io_wakeup(f, LSC_IOWRITE, 1);
+    lua_pop(L, 2); /* keep f alive until now */
+    return 1;
+}
+
+static int io_spin(lsc_State *s, io_state *io, int *timeout) {
+    lsc_Clock start = clock_ns(), spent = 0;
+    unsigned long limit;
+    int n;
+    if (io->spin == 0 || io->spin > s->spin)
+        io->spin = s->spin;
+    limit = io->spin;
+    if (*timeout > 0 && limit > (unsigned long)*timeout * 1000000UL)
+        limit = (unsigned long)*timeout * 1000000UL;
+    while ((n = epoll_wait(io->epfd, io->events, LSC_IO_BATCH, 0)) == 0
+            && (spent = clock_ns() - start) < limit)
+        ;
+    if (n != 0) { /* caught, spin longer next time */
+        io->spin = io->spin > s->spin / 2 ? s->spin : io->spin * 2;
+        return n;
+    }
+    /* in vain, shrink to 1/16 of max at least */
+    if (io->spin / 2 >= s->spin / 16)
+        io->spin /= 2;
+    if (*timeout > 0) {
+        *timeout -= (int)(spent / 1000000UL);
+        if (*timeout < 0) *timeout = 0;
+    }
+    return 0;
+}
+
+LSC_API int lsc_iopoll(lsc_State *s, lua_State *from, void *ud) {
+    io_state *io = (io_state*)s->io;
+    int i, n = 0, weak = 0, timeout;
+    if (io == NULL || (!io_drain(s, from, io) && io->nfds == 0))
+        return 0;
+    timeout = lsc_nexttimeout(s);
+    if (timeout != 0 && s->spin != 0)
+        n = io_spin(s, io, &timeout);
+    if (n == 0)
+        n = epoll_wait(io->epfd, io->events, LSC_IO_BATCH, timeout);
+    for (i = 0; i < n; ++i) {
+        io_fd *f = (io_fd*)io->events[i].data.ptr;
+        unsigned ev = (unsigned)io->events[i].events;
+        if (f->drain != NULL) {
+            weak = 1;
+            continue;
+        }
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            io_wakeup(f, LSC_IOREAD, 0);
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            io_wakeup(f, LSC_IOWRITE, 0);
+    }
+    if (weak)
+        io_drain(s, from, io);
+    return 1; /* registered fds keep loop running */
+}
+
+#endif /* LSC_USE_EPOLL */
+
+
+/* cluster */
+
+#ifdef LSC_USE_CLUSTER
+
+#ifndef __GNUC__
+# error "LSC_USE_CLUSTER needs the __atomic builtins of GCC or Clang"
+#endif
+
+#define LSC_PACK_DEPTH 64
+
+typedef struct cluster_msg {
+    struct cluster_msg *next;
+    size_t len; /* serialised values follows */
+    int from;
+} cluster_msg;
+
+#define msg_data(m) ((char*)((cluster_msg*)(m) + 1))
+
+typedef struct cluster cluster;
+
+typedef struct cluster_box {
+    cluster_msg *head; /* last pushed, shared by producers */
+    cluster_msg *tail; /* next to pop, owned by consumer */
+    cluster_msg stub;
+    int notified; /* efd written and not read */
+    int closing, closed;
+    int efd, id;
+    cluster *C;
+    io_fd *fd; /* record of efd in the owner */
+    char *errmsg;
+    pthread_t thread;
+} cluster_box;
+
+struct cluster {
+    int n;       /* workers, except the worker 0 */
+    int started; /* threads created */
+    int joined;
+    char *code;
+    size_t codelen;
+    cluster_msg *args;
+    cluster_box boxes[1]; /* n + 1 boxes */
+};
+
+/* Vyukov's intrusive MPSC queue */
+
+static void box_push(cluster_box *b, cluster_msg *m) {
+    cluster_msg *prev;
+    __atomic_store_n(&m->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&b->head, m, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+static cluster_msg *box_pop(cluster_box *b) {
+    cluster_msg *tail = b->tail, *next, *head;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &b->stub) {
+        if (next == NULL) return NULL;
+        b->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        b->tail = next;
+        return tail;
+    }
+    head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+    if (tail != head)
+        return NULL; /* producer is pushing, try next time */
+    box_push(b, &b->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        b->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void box_notify(cluster_box *b) {
+    /* only the first message after drained writes efd */
+    if (__atomic_exchange_n(&b->notified, 1, __ATOMIC_SEQ_CST) == 0)
+        eventfd_write(b->efd, 1);
+}
+
+static size_t pack_value(lua_State *L, int idx, char *p, int depth) {
+    size_t n = 1; /* type tag */
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        if (p) *p = 'n';
+        break;
+    case LUA_TBOOLEAN:
+        if (p) *p = lua_toboolean(L, idx) ? 't' : 'f';
+        break;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            lua_Integer i = lua_tointeger(L, idx);
+            if (p) {
+                *p = 'i';
+                memcpy(p + 1, &i, sizeof(i));
+            }
+            n += sizeof(i);
+            break;
+        }
+#endif
+        {
+            lua_Number d = lua_tonumber(L, idx);
+            if (p) {
+                *p = 'd';
+                memcpy(p + 1, &d, sizeof(d));
+            }
+            n += sizeof(d);
+        }
+        break;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *s = lua_tolstring(L, idx, &len);
+        if (p) {
+            *p = 's';
+            memcpy(p + 1, &len, sizeof(len));
+            memcpy(p + 1 + sizeof(len), s, len);
+        }
+        n += sizeof(len) + len;
+        break;
+    }
+    case LUA_TTABLE:
+        if (depth >= LSC_PACK_DEPTH)
+            luaL_error(L, "table too deep (or cyclic) to send");
+        luaL_checkstack(L, 3, "table too deep to send");
+        idx = lua_absindex(L, idx);
+        if (p) *p = '{';
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            n += pack_value(L, -2, p ? p + n : NULL, depth + 1);
+            n += pack_value(L, -1, p ? p + n : NULL, depth + 1);
+            lua_pop(L, 1);
+        }
+        if (p) p[n] = '}';
+        ++n;
+        break;
+    default:
+        luaL_error(L, "can not send a %s value", luaL_typename(L, idx));
+    }
+    return n;
+}
+
+static cluster_msg *pack_msg(lua_State *L, int from, int first, int last) {
+    cluster_msg *m;
+    size_t len = 0;
+    char *p;
+    int i;
+    /* get size first, so nothing leaks when errors */
+    for (i = first; i <= last; ++i)
+        len += pack_value(L, i, NULL, 0);
+    if ((m = (cluster_msg*)malloc(sizeof(cluster_msg) + len)) == NULL)
+        luaL_error(L, "not enough memory");
+    m->len = len;
+    m->from = from;
+    for (p = msg_data(m), i = first; i <= last; ++i)
+        p += pack_value(L, i, p, 0);
+    return m;
+}
+
+static const char *unpack_value(lua_State *L, const char *p) {
+    switch (*p++) {
+    case 'n': lua_pushnil(L); break;
+    case 't': lua_pushboolean(L, 1); break;
+    case 'f': lua_pushboolean(L, 0); break;
+#if LUA_VERSION_NUM >= 503
+    case 'i': {
+        lua_Integer i;
+        memcpy(&i, p, sizeof(i));
+        lua_pushinteger(L, i);
+        p += sizeof(i);
+        break;
+    }
+#endif
+    case 'd': {
+        lua_Number d;
+        memcpy(&d, p, sizeof(d));
+        lua_pushnumber(L, d);
+        p += sizeof(d);
+        break;
+    }
+    case 's': {
+        size_t len;
+        memcpy(&len, p, sizeof(len));
+        lua_pushlstring(L, p + sizeof(len), len);
+        p += sizeof(len) + len;
+        break;
+    }
+    case '{':
+        lua_newtable(L);
+        luaL_checkstack(L, 3, "table too deep");
+        while (*p != '}') {
+            p = unpack_value(L, p);
+            p = unpack_value(L, p);
+            lua_rawset(L, -3);
+        }
+        ++p;
+        break;
+    }
+    return p;
+}
+
+static int unpack_msg(lua_State *L, cluster_msg *m) {
+    const char *p = msg_data(m), *e = p + m->len;
+    int n = 0;
+    for (; p < e; ++n) {
+        luaL_checkstack(L, 1, "too many values");
+        p = unpack_value(L, p);
+    }
+    return n;
+}
+
+static int box_drain(lsc_State *S, lua_State *from, void *ud);
+
+static void box_attach(lua_State *L, cluster_box *b) {
+    lsc_State *S = lsc_state(L);
+    if ((b->fd = io_weakfd(L, S, b->efd, box_drain, b)) == NULL)
+        luaL_error(L, "can not poll mailbox: %s", strerror(errno));
+    S->mailbox = b;
+}
+
+static void box_close(lsc_State *S, cluster_box *b) {
+    b->closed = 1;
+    lsc_closefd(S->main->L, b->efd); /* wake up waitting tasks */
+}
+
+static int box_drain(lsc_State *S, lua_State *from, void *ud) {
+    cluster_box *b = (cluster_box*)ud;
+    lsc_Signal *s = &b->fd->read;
+    cluster_msg *m;
+    eventfd_t v;
+    int n = LSC_CLUSTER_BATCH;
+    if (b->closed) return 0;
+    if (__atomic_exchange_n(&b->notified, 0, __ATOMIC_SEQ_CST))
+        eventfd_read(b->efd, &v);
+    /* make receivers ready like `io_wakeup`, so priorities and
+     * budgets apply to them */
+    while (lsc_count(s) != 0 && (m = box_pop(b)) != NULL) {
+        lsc_Task *t = lsc_next(s, NULL);
+        lua_State *L = task_state(t);
+        fire_task(t, s);
+        lsc_setcontext(L, t, 0); /* clean up context */
+        lua_pushinteger(L, m->from);
+        unpack_msg(L, m);
+        free(m);
+        lsc_ready(t, lua_gettop(L));
+        assert(t->waitat != s);
+        if (--n == 0) {
+            box_notify(b); /* rest messages in next tick */
+            break;
+        }
+    }
+    if (__atomic_load_n(&b->closing, __ATOMIC_ACQUIRE))
+        box_close(S, b);
+    return lsc_count(s) != 0;
+}
+
+static int cluster_run(lua_State *L) {
+    cluster_box *b = (cluster_box*)lua_touserdata(L, 1);
+    cluster *C = b->C;
+    lsc_State *S = lsc_state(L);
+    int nargs = 0;
+    box_attach(L, b);
+    if (luaL_loadbuffer(L, C->code, C->codelen, "=cluster") != LUA_OK)
+        lua_error(L);
+    lua_pushinteger(L, b->id);
+    lua_pushinteger(L, C->n);
+    if (C->args != NULL)
+        nargs = unpack_msg(L, C->args);
+    lua_call(L, nargs + 2, 0);
+    if (!lsc_loop(S, L)) {
+        lsc_collect(L, S, NULL, NULL);
+        lua_error(L);
+    }
+    return 0;
+}
+
+static void *cluster_thread(void *ud) {
+    cluster_box *b = (cluster_box*)ud;
+    lua_State *L = luaL_newstate();
+    const char *errmsg = "not enough memory";
+    if (L != NULL) {
+        luaL_openlibs(L);
+        lsc_install(L);
+        lua_pushcfunction(L, cluster_run);
+        lua_pushlightuserdata(L, b);
+        errmsg = lua_pcall(L, 1, 0, 0) == LUA_OK ? NULL :
+            lua_isstring(L, -1) ? lua_tostring(L, -1) :
+            "error object is not a string";
+    }
+    if (errmsg != NULL && (b->errmsg = (char*)malloc(strlen(errmsg) + 1)))
+        strcpy(b->errmsg, errmsg);
+    if (L != NULL) lua_close(L);
+    return NULL;
+}
+
+static void cluster_stop(cluster *C) {
+    int i;
+    if (C->joined) return;
+    for (i = 1; i <= C->n; ++i) {
+        __atomic_store_n(&C->boxes[i].closing, 1, __ATOMIC_RELEASE);
+        if (C->boxes[i].efd >= 0)
+            box_notify(&C->boxes[i]);
+    }
+    for (i = 1; i <= C->started; ++i)
+        pthread_join(C->boxes[i].thread, NULL);
+    C->joined = 1;
+}
+
+static void cluster_free(cluster *C) {
+    int i;
+    cluster_stop(C);
+    for (i = 0; i <= C->n; ++i) {
+        cluster_box *b = &C->boxes[i];
+        cluster_msg *m;
+        while ((m = box_pop(b)) != NULL)
+            free(m);
+        if (b->efd >= 0) close(b->efd);
+        free(b->errmsg);
+    }
+    free(C->args);
+    free(C->code);
+    free(C);
+}
+
+LSC_API int lsc_send(lua_State *L, int to, int nargs) {
+    cluster_box *b = (cluster_box*)lsc_state(L)->mailbox;
+    int top = lua_gettop(L);
+    cluster_msg *m;
+    if (b == NULL || to < 0 || to > b->C->n)
+        return 0;
+    m = pack_msg(L, b->id, top - nargs + 1, top);
+    b = &b->C->boxes[to];
+    box_push(b, m);
+    box_notify(b);
+    return 1;
+}
+
+#endif /* LSC_USE_CLUSTER */
+
+/* offload */
+
+#ifdef LSC_USE_OFFLOAD
+
+typedef struct offload_job {
+    struct offload_job *next;
+    lsc_Signal wait; /* the task waitting for this job */
+    lsc_Work *work;
+    lsc_WorkDone *done;
+    void *ud;
+    int ref; /* the task object, keep it from collected */
+} offload_job;
+
+typedef struct offload_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    offload_job *jobs, **jobstail; /* FIFO waitting for threads */
+    offload_job *finished; /* LIFO waitting for scheduler */
+    size_t pending; /* jobs not finished, only used by scheduler */
+    int stop;
+    int efd;
+    int nthreads;
+    pthread_t threads[LSC_OFFLOAD_THREADS];
+} offload_pool;
+
+static void *offload_thread(void *ud) {
+    offload_pool *p = (offload_pool*)ud;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        offload_job *job;
+        while (!p->stop && p->jobs == NULL)
+            pthread_cond_wait(&p->cond, &p->lock);
+        if (p->stop) break;
+        job = p->jobs;
+        if ((p->jobs = job->next) == NULL)
+            p->jobstail = &p->jobs;
+        pthread_mutex_unlock(&p->lock);
+        job->work(job->ud);
+        pthread_mutex_lock(&p->lock);
+        job->next = p->finished;
+        p->finished = job;
+        eventfd_write(p->efd, 1);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void offload_finish(lsc_State *S, offload_job *job) {
+    lsc_Task *t = lsc_next(&job->wait, NULL);
+    if (t != NULL && lsc_status(t) == lsc_Waitting) {
+        lua_State *L = task_state(t);
+        fire_task(t, &job->wait);
+        lsc_setcontext(L, t, 0);
+        lsc_ready(t, job->done(L, job->ud));
+    }
+    else {
+        if (t != NULL) queue_removeself(&t->head); /* task deleted */
+        job->done(NULL, job->ud);
+    }
+    luaL_unref(S->main->L, LUA_REGISTRYINDEX, job->ref);
+    free(job);
+}
+
+static int offload_drain(lsc_State *S, lua_State *from, void *ud) {
+    offload_pool *p = (offload_pool*)ud;
+    offload_job *job, *list = NULL;
+    eventfd_t v;
+    if (p->pending == 0) return 0;
+    eventfd_read(p->efd, &v);
+    pthread_mutex_lock(&p->lock);
+    job = p->finished;
+    p->finished = NULL;
+    pthread_mutex_unlock(&p->lock);
+    while (job != NULL) { /* reverse to finished order */
+        offload_job *next = job->next;
+        job->next = list;
+        list = job;
+        job = next;
+    }
+    while ((job = list) != NULL) {
+        list = job->next;
+        --p->pending;
+        offload_finish(S, job);
+    }
+    return p->pending != 0;
+}
+
+static int offload_gc(lua_State *L) {
+    offload_pool *p = (offload_pool*)lua_touserdata(L, 1);
+    offload_job *job;
+    int i;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1; /* running jobs are finished, waitting ones dropped */
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->nthreads; ++i)
+        pthread_join(p->threads[i], NULL);
+    while ((job = p->jobs) != NULL || (job = p->finished) != NULL) {
+        if (job == p->jobs) p->jobs = job->next;
+        else p->finished = job->next;
+        job->done(NULL, job->ud);
+        free(job);
+    }
+    if (p->efd >= 0) close(p->efd);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    return 0;
+}
+
+static offload_pool *offload_init(lua_State *L, lsc_State *S) {
+    offload_pool *p;
+    lua53_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_OFFLOAD);
+    p = (offload_pool*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (p != NULL) return p;
+    p = (offload_pool*)lua_newuserdata(L, sizeof(offload_pool));
+    memset(p, 0, sizeof(offload_pool));
+    p->jobstail = &p->jobs;
+    p->efd = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (luaL_newmetatable(L, "sched.offload")) {
+        lua_pushcfunction(L, offload_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    if ((p->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+        goto err;
+    for (; p->nthreads < LSC_OFFLOAD_THREADS; ++p->nthreads)
+        if ((errno = pthread_create(&p->threads[p->nthreads], NULL,
+                        offload_thread, p)) != 0)
+            break;
+    /* register eventfd at last, the drain must not see a dead pool */
+    if (p->nthreads == 0 || io_weakfd(L, S, p->efd, offload_drain, p) == NULL)
+        goto err;
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_OFFLOAD);
+    return p;
+err:
+    lua_pop(L, 1); /* the pool will be freed in __gc */
+    return NULL;
+}
+
+LSC_API int lsc_offload(lsc_Task *t, lsc_Work *work, lsc_WorkDone *done, void *ud) {
+    lua_State *L;
+    offload_pool *p;
+    offload_job *job;
+    if (lsc_status(t) < 0) { /* dead, finished or error */
+        errno = EINVAL;
+        return -1;
+    }
+    L = task_state(t);
+    if ((p = offload_init(L, t->S)) == NULL)
+        return -1;
+    if ((job = (offload_job*)malloc(sizeof(offload_job))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    lsc_initsignal(&job->wait);
+    job->next = NULL;
+    job->work = work;
+    job->done = done;
+    job->ud = ud;
+    if (!lsc_pushtask(L, t)) lua_pushnil(L);
+    job->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ++p->pending;
+    pthread_mutex_lock(&p->lock);
+    *p->jobstail = job;
+    p->jobstail = &job->next;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return lsc_wait(t, &job->wait, 0);
+}
+
+#endif /* LSC_USE_OFFLOAD */
+
+
+/* lua type maintains */
+
+LSC_API lsc_Task *lsc_checktask(lua_State *L, int idx) {
+    lsc_Task *t = (lsc_Task*)luaL_checkudata(L, idx, "sched.task");
+    if (lsc_status(t) == lsc_Dead)
+        luaL_argerror(L, idx, "got deleted task");
+    return t;
+}
+
+LSC_API lsc_Task *lsc_testtask(lua_State *L, int idx) {
+    return (lsc_Task*)luaL_testudata(L, idx, "sched.task");
+}
+
+LSC_API int lsc_pushtask(lua_State *L, lsc_Task *t) {
+    if (t == NULL)
+        return 0;
+#ifdef LSC_LAZY_TASK
+    if (t->ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, t->ref);
+        return 1;
+    }
+    get_weakbox(L); /* finished task */
+    if (lua_rawgetp(L, -1, t) == LUA_TNIL) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_remove(L, -2);
+    return 1;
+#else
+    get_taskbox(L);
+    lua_pushthread(t->L);
+    lua_xmove(t->L, L, 1);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_remove(L, -2);
+    return 1;
+#endif
+}
+
+LSC_API lsc_Signal *lsc_checksignal(lua_State *L, int idx) {
+    lsc_Signal *s = (lsc_Signal*)luaL_checkudata(L, idx, "sched.signal");
+    if (!lsc_signalvalid(s))
+        luaL_argerror(L, idx, "got deleted signal");
+    return s;
+}
+
+LSC_API lsc_Signal *lsc_testsignal(lua_State *L, int idx) {
+    return (lsc_Signal*)luaL_testudata(L, idx, "sched.signal");
+}
+
+
+/* signal module interface */
+
+static int Lsignal_new(lua_State *L) {
+    lsc_newsignal(L, 0);
+    return 1;
+}
+
+static int Lsignal_delete(lua_State *L) {
+    lsc_Signal *s = lsc_testsignal(L, 1);
+    if (s != NULL) lsc_deletesignal(s, L);
+    return 0;
+}
+
+static int Lsignal_tostring(lua_State *L) {
+    lsc_Signal *s = lsc_testsignal(L, 1);
+    if (s == NULL)
+        luaL_tolstring(L, -1, NULL);
+    else if (!lsc_signalvalid(s))
+        lua_pushfstring(L, "sched.signal(deleted): %p", s);
+    else
+        lua_pushfstring(L, "sched.signal: %p", s);
+    return 1;
+}
+
+static int Lsignal_emit(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    int top = lua_gettop(L) - 1;
+    lua_pushboolean(L, lsc_emit(s, L, top == 0 ? -1 : top));
+    return 1;
+}
+
+static int Lsignal_ready(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    int top = lua_gettop(L) - 1;
+    luaL_checkstack(L, top, "too many args");
+    move_tasks(s, NULL, 1, L, top);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lsignal_hold(lua_State *L) {
+    lsc_holdall(lsc_checksignal(L, 1));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lsignal_move(lua_State *L) {
+    lsc_moveall(lsc_checksignal(L, 1), lsc_checksignal(L, 2));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lsignal_one(lua_State *L) {
+    lsc_Task *t;
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    int top = lua_gettop(L) - 1;
+    if ((t = lsc_next(s, NULL)) != NULL) {
+        fire_task(t, s);
+        lsc_setcontext(L, t, top);
+        lsc_wakeup(t, L, top);
+    }
+    return 1;
+}
+
+static int Lsignal_filter(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    lsc_Task *t = lsc_next(s, NULL);
+    lua_settop(L, 2);
+    while (t != NULL) {
+        int n;
+        lsc_Task *next = lsc_next(s, t);
+        lua_pushvalue(L, -1);
+        lsc_pushtask(L, t);
+        n = lsc_getcontext(L, t) + 1;
+        lua_call(L, n, 0);
+        t = next;
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Lsignal_next(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    lsc_Task *t = lua_isnoneornil(L, 2) ? NULL :
+        lsc_checktask(L, 2);
+    return lsc_pushtask(L, lsc_next(s, t));
+}
+
+static int Lsignal_count(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    lua_pushinteger(L, lsc_count(s));
+    return 1;
+}
+
+static int Lsignal_index(lua_State *L) {
+    lsc_Signal *s = lsc_checksignal(L, 1);
+    lua_Integer idx = luaL_optinteger(L, 2, 1);
+    if (idx > 0) --idx;
+    return lsc_pushtask(L, lsc_index(s, (int)idx));
+}
+
+/* keyed signal: a table in uservalue maps keys to signals, a signal
+ * is created at the first wait of it's key, and dropped when no tasks
+ * wait on it. so wakeup a key costs O(1) whatever others waitting.
+ * a waitting task anchors the signal in it's frame, the table is weak
+ * so signals left by deleted tasks are dropped by GC, other ways of
+ * leaving drop it when the last task resumes, see `keyed_waitk` */
+
+static lsc_Signal *keyed_push(lua_State *L) {
+    /* stack: keyed, key; push the signal of key, or nil */
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    return (lsc_Signal*)lua_touserdata(L, -1);
+}
+
+static void keyed_drop(lua_State *L, lsc_Signal *s) {
+    /* stack: keyed, key */
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (lua_touserdata(L, -1) == (void*)s && lsc_count(s) == 0) {
+        lua_pushvalue(L, 2);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+}
+
+static int Lsignal_keyed(lua_State *L) {
+    lua_newuserdata(L, 0);
+    luaL_setmetatable(L, "sched.keyed");
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int keyed_resumed(lua_State *L) {
+    /* stack: keyed, key, signal, values resumed with */
+    keyed_drop(L, (lsc_Signal*)lua_touserdata(L, 3));
+    return lua_gettop(L) - 3;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int keyed_waitk(lua_State *L, int status, lua_KContext ctx)
+{ (void)status; (void)ctx; return keyed_resumed(L); }
+#else
+static int keyed_waitk(lua_State *L)
+{ return keyed_resumed(L); }
+#endif
+
+static int Lkeyed_wait(lua_State *L) {
+    lsc_Task *t = lsc_current(L);
+    int top = lua_gettop(L);
+    lsc_Signal *s;
+    luaL_checkudata(L, 1, "sched.keyed");
+    luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "key expected");
+    if (t == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    if ((s = keyed_push(L)) == NULL) {
+        lua_pop(L, 1);
+        lua_getuservalue(L, 1);
+        lua_pushvalue(L, 2);
+        s = lsc_newsignal(L, 0);
+        lua_pushvalue(L, -1);
+        lua_insert(L, -4);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    lua_insert(L, 3); /* anchor signal below contexts */
+    wait_signal(t, s);
+    return lua_yieldk(L, top - 2, 0, keyed_waitk);
+}
+
+static int Lkeyed_emit(lua_State *L) {
+    int n, top = lua_gettop(L) - 2;
+    lsc_Signal *s;
+    luaL_checkudata(L, 1, "sched.keyed");
+    luaL_checkany(L, 2);
+    if ((s = keyed_push(L)) == NULL) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_insert(L, 3); /* keep signal alive when emitting */
+    n = lsc_emit(s, L, top == 0 ? -1 : top);
+    keyed_drop(L, s);
+    lua_pushboolean(L, n);
+    return 1;
+}
+
+static int Lkeyed_count(lua_State *L) {
+    lsc_Signal *s;
+    luaL_checkudata(L, 1, "sched.keyed");
+    luaL_checkany(L, 2);
+    s = keyed_push(L);
+    lua_pushinteger(L, s != NULL ? (lua_Integer)lsc_count(s) : 0);
+    return 1;
+}
+
+LSCLUA_API int luaopen_sched_signal(lua_State *L) {
+    luaL_Reg keyed[] = {
+#define ENTRY(name) { #name, Lkeyed_##name }
+        ENTRY(wait),
+        ENTRY(emit),
+        ENTRY(count),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg libs[] = {
+        { "__gc", Lsignal_delete },
+        { "__tostring", Lsignal_tostring },
+#define ENTRY(name) { #name, Lsignal_##name }
+        ENTRY(new),
+        ENTRY(keyed),
+        ENTRY(delete),
+        ENTRY(emit),
+        ENTRY(ready),
+        ENTRY(hold),
+        ENTRY(move),
+        ENTRY(one),
+        ENTRY(filter),
+        ENTRY(next),
+        ENTRY(count),
+        ENTRY(index),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, "sched.keyed")) {
+        luaL_setfuncs(L, keyed, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+    if (luaL_newmetatable(L, "sched.signal")) {
+        luaL_setfuncs(L, libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    return 1;
+}
+
+
+/* task module interface */
+
+static int Ltask_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    /* not pooled, the function may keep it's coroutine */
+    spawn_task(L, lua_gettop(L) - 1, 0);
+    assert(lua_gettop(L) == 1);
+    return 1;
+}
+
+static int Ltask_delete(lua_State *L) {
+    lsc_Task *t = lsc_testtask(L, 1);
+    if (t != NULL)
+        lsc_deletetask(t, L);
+    return 0;
+}
+
+static int Ltask_tostring(lua_State *L) {
+    lsc_Task *t = lsc_testtask(L, 1);
+    if (t == NULL)
+        luaL_tolstring(L, -1, NULL);
+    else {
+        const char *s;
+        switch (lsc_status(t)) {
+        case lsc_Finished: s = "finish"; break;
+        case lsc_Error:    s = "error";  break;
+        case lsc_Dead:     s = "dead";   break;
+        default:           s = NULL;     break;
+        }
+        if (s != NULL)
+            lua_pushfstring(L, "sched.task(%s): %p", s, t);
+        else
+            lua_pushfstring(L, "sched.task: %p", t);
+    }
+    return 1;
+}
+
+static lsc_Task *default_task(lua_State *L, int *parg) {
+    int arg = 2;
+    lsc_Task *t = lsc_testtask(L, 1);
+    if (t == NULL) {
+        arg = 1; 
+        t = lsc_current(L);
+    }
+    if (t == NULL)
+        luaL_error(L, "current coroutine is not a task");
+    if (parg) *parg = arg;
     return t;
 }
 
-static void wakeup_joins(lsc_Task *t, lua_State *from) {
-    lsc_Signal joined;
-    int nrets = 2, stat = lua_status(t->L);
-    if (from == NULL)
-        from = t->L;
-    /* replace and invalid joined queue */
-    t->waitat = NULL;
-    queue_removeself(&t->head);
-    lsc_initsignal(&t->head);
-    if (!lsc_signalvalid(&t->joined))
-        return;
-    queue_replace(&joined, &t->joined);
-    /* calc return values */
-    switch (stat) {
-    case LUA_YIELD:
-        lua_pushnil(from);
-        lua_pushstring(from, "task deleted");
-        nrets += lsc_getcontext(from, t);
-        break;
-    case LUA_OK:
-        lua_pushboolean(from, 1);
-        nrets += lsc_getcontext(from, t) - 1;
-        break;
-    default:
-        lua_pushnil(from);
-        lua_pushvalue(t->L, 1);
-        if (t->L != from)
-            lua_xmove(t->L, from, 1);
-        break;
+static int Ltask_wait(lua_State *L) {
+    int arg, top = lua_gettop(L);
+    lsc_Task *t = default_task(L, &arg);
+    lsc_Signal *s = lsc_checksignal(L, arg);
+    lsc_wait(t, s, top - arg);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Ltask_waitany(lua_State *L) {
+    lsc_Signal *buff[LUA_MINSTACK], **signals = buff;
+    int i, arg, n;
+    lsc_Task *t = default_task(L, &arg);
+    n = lua_gettop(L) - arg + 1;
+    if (n > LUA_MINSTACK)
+        signals = (lsc_Signal**)lua_newuserdata(L, n * sizeof(lsc_Signal*));
+    for (i = 0; i < n; ++i)
+        signals[i] = lsc_checksignal(L, arg + i);
+    lsc_waitany(t, signals, n, 0);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static lsc_Time aux_deadline(lua_State *L, int idx) {
+    lua_Number ms = luaL_checknumber(L, idx) * 1000;
+    lsc_Time delay = ms > 0 ? (lsc_Time)ms : 0;
+    if ((lua_Number)delay < ms) ++delay; /* never wakeup early */
+    return lsc_now() + delay;
+}
+
+static int Ltask_waitfor(lua_State *L) {
+    int arg, nctx, top = lua_gettop(L);
+    lsc_Task *t = default_task(L, &arg);
+    lsc_Signal *s = lua_isnil(L, arg) ? NULL : lsc_checksignal(L, arg);
+    nctx = top > arg ? top - arg - 1 : 0;
+    if (lua_isnoneornil(L, arg + 1))
+        lsc_wait(t, s, nctx);
+    else
+        lsc_waitfor(t, s, aux_deadline(L, arg + 1), nctx);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Ltask_ready(lua_State *L) {
+    int arg, top = lua_gettop(L);
+    lsc_Task *t = default_task(L, &arg);
+    lsc_ready(t, top - arg);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Ltask_hold(lua_State *L) {
+    int arg, top = lua_gettop(L);
+    lsc_Task *t = default_task(L, &arg);
+    lsc_hold(t, top - arg);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int Ltask_wakeup(lua_State *L) {
+    int res, top = lua_gettop(L) - 1;
+    lsc_Task *t = lsc_checktask(L, 1);
+    lsc_Status s;
+    if (top != 0) { /* replace context? */
+        if (lua_status(task_state(t)) == LUA_OK) /* first run? */
+            lua_settop(t->L, 1); /* clear original context */
+        lua_xmove(L, t->L, top);
+    }
+    lsc_wakeup(t, L, top == 0 ? -1 : top);
+    s = lsc_status(t);
+    assert(s != lsc_Running);
+    lua_pushboolean(L, s != lsc_Error);
+    res = lsc_getcontext(L, t) + 1;
+    if (s == lsc_Finished)
+        lsc_deletetask(t, L);
+    return res;
+}
+
+static int Ltask_context(lua_State *L) {
+    int top = lua_gettop(L) - 1;
+    lsc_Task *t = lsc_checktask(L, 1);
+    if (lsc_status(t) == lsc_Running)
+        return 0;
+    if (top > 0) { /* set context */
+        lua_settop(task_state(t), 0);
+        lua_xmove(L, t->L, top);
+        lua_settop(L, 1);
+        return 1;
+    }
+    return lsc_getcontext(L, t);
+}
+
+static int Ltask_join(lua_State *L) {
+    lsc_Task *t, *jointo;
+    int top = lua_gettop(L);
+    t = lsc_checktask(L, 1);
+    if (top == 1) {
+        jointo = t;
+        t = lsc_current(L);
+    }
+    else
+        jointo = lsc_checktask(L, 2);
+    lua_pushboolean(L, lsc_join(t, jointo, -1));
+    return 1;
+}
+
+static int Ltask_priority(lua_State *L) {
+    int arg;
+    lsc_Task *t = default_task(L, &arg);
+    if (lua_isnoneornil(L, arg)) {
+        lua_pushinteger(L, t->priority);
+        return 1;
+    }
+    lsc_setpriority(t, (int)luaL_checkinteger(L, arg));
+    lua_settop(L, 1);
+    return 1;
+}
+
+#ifdef LSC_USE_STATS
+static void aux_pushstats(lua_State *L, lsc_Task *t) {
+    lsc_TaskStats stats;
+    lsc_taskstats(t, &stats);
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)stats.resumes);
+    lua_setfield(L, -2, "resumes");
+    lua_pushnumber(L, stats.cpu);
+    lua_setfield(L, -2, "cpu");
+    lua_pushnumber(L, stats.maxslice);
+    lua_setfield(L, -2, "maxslice");
+    lua_pushnumber(L, stats.ready);
+    lua_setfield(L, -2, "ready");
+    lua_pushnumber(L, stats.wait);
+    lua_setfield(L, -2, "wait");
+}
+
+static int Ltask_stats(lua_State *L) {
+    aux_pushstats(L, default_task(L, NULL));
+    return 1;
+}
+#endif
+
+static int Ltask_status(lua_State *L) {
+    lsc_Task *t = default_task(L, NULL);
+    const char *s = NULL;
+    switch (lsc_status(t)) {
+    case lsc_Finished: s = "finish";   break;
+    case lsc_Error:    s = "error";    break;
+    case lsc_Dead:     s = "dead";     break;
+    case lsc_Running:  s = "running";  break;
+    case lsc_Waitting: s = "waitting"; break;
+    case lsc_Hold:     s = "hold";     break;
+    case lsc_Ready:    s = "ready";    break;
+    }
+    lua_pushstring(L, s);
+    return 1;
+}
+
+LSCLUA_API int luaopen_sched_task(lua_State *L) {
+    luaL_Reg libs[] = {
+        { "__gc", Ltask_delete },
+        { "__tostring", Ltask_tostring },
+#define ENTRY(name) { #name, Ltask_##name }
+        ENTRY(new),
+        ENTRY(delete),
+        ENTRY(wait),
+        ENTRY(waitfor),
+        ENTRY(waitany),
+        ENTRY(ready),
+        ENTRY(hold),
+        ENTRY(wakeup),
+        ENTRY(context),
+        ENTRY(join),
+        ENTRY(status),
+        ENTRY(priority),
+#ifdef LSC_USE_STATS
+        ENTRY(stats),
+#endif
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, "sched.task")) {
+        luaL_setfuncs(L, libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    return 1;
+}
+
+
+/* I/O module interface */
+
+#ifdef LSC_USE_EPOLL
+
+static int Lio_wait(lua_State *L) {
+    static const char *const modes[] = { "r", "w", NULL };
+    lsc_Task *t = lsc_current(L);
+    int fd = (int)luaL_checkinteger(L, 1);
+    int events = luaL_checkoption(L, 2, NULL, modes) + 1;
+    if (t == NULL)
+        luaL_error(L, "current coroutine is not a task");
+    if (lsc_waitfd(t, fd, events, lua_gettop(L) - 2) < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1); /* ready already */
+    return 1;
+}
+
+static int Lio_close(lua_State *L) {
+    int fd = (int)luaL_checkinteger(L, 1);
+    lua_pushboolean(L, lsc_closefd(L, fd));
+    return 1;
+}
+
+static int Lio_fileno(lua_State *L) {
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *p = (luaL_Stream*)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    FILE *f = p->closef != NULL ? p->f : NULL;
+#else
+    FILE *f = *(FILE**)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+#endif
+    luaL_argcheck(L, f != NULL, 1, "attempt to use a closed file");
+    lua_pushinteger(L, fileno(f));
+    return 1;
+}
+
+LSCLUA_API int luaopen_sched_io(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lio_##name }
+        ENTRY(wait),
+        ENTRY(close),
+        ENTRY(fileno),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+#endif /* LSC_USE_EPOLL */
+
+
+/* cluster module interface */
+
+#ifdef LSC_USE_CLUSTER
+
+static cluster **cluster_anchor(lua_State *L) {
+    cluster **pc;
+    lua53_rawgetp(L, LUA_REGISTRYINDEX, (void*)LSC_CLUSTER);
+    pc = (cluster**)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return pc;
+}
+
+static int cluster_gc(lua_State *L) {
+    cluster **pc = (cluster**)lua_touserdata(L, 1);
+    if (*pc != NULL) {
+        cluster_free(*pc);
+        *pc = NULL;
+    }
+    return 0;
+}
+
+static int Lcluster_start(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    int i, n = (int)luaL_checkinteger(L, 1), top = lua_gettop(L);
+    size_t len;
+    const char *code = luaL_checklstring(L, 2, &len);
+    cluster **pc, *C;
+    luaL_argcheck(L, n > 0, 1, "need one worker at least");
+    if (S->mailbox != NULL)
+        return luaL_error(L, "cluster already started");
+    pc = (cluster**)lua_newuserdata(L, sizeof(cluster*));
+    *pc = NULL;
+    if (luaL_newmetatable(L, "sched.cluster")) {
+        lua_pushcfunction(L, cluster_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    C = (cluster*)malloc(sizeof(cluster) + n * sizeof(cluster_box));
+    if (C == NULL)
+        return luaL_error(L, "not enough memory");
+    memset(C, 0, sizeof(cluster) + n * sizeof(cluster_box));
+    C->n = n;
+    *pc = C;
+    for (i = 0; i <= n; ++i) {
+        cluster_box *b = &C->boxes[i];
+        b->stub.next = NULL;
+        b->head = b->tail = &b->stub;
+        b->id = i;
+        b->C = C;
+        b->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    for (i = 0; i <= n; ++i)
+        if (C->boxes[i].efd < 0)
+            return luaL_error(L, "can not create mailbox: %s",
+                    strerror(errno));
+    if ((C->code = (char*)malloc(len)) == NULL)
+        return luaL_error(L, "not enough memory");
+    memcpy(C->code, code, len);
+    C->codelen = len;
+    if (top > 2)
+        C->args = pack_msg(L, 0, 3, top);
+    box_attach(L, &C->boxes[0]);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_CLUSTER);
+    for (i = 1; i <= n; ++i) {
+        if (pthread_create(&C->boxes[i].thread, NULL,
+                    cluster_thread, &C->boxes[i]) != 0)
+            return luaL_error(L, "can not start worker %d", i);
+        C->started = i;
+    }
+    return 0;
+}
+
+static int Lcluster_send(lua_State *L) {
+    cluster_box *b = (cluster_box*)lsc_state(L)->mailbox;
+    int to = (int)luaL_checkinteger(L, 1);
+    if (b == NULL)
+        return luaL_error(L, "not in a cluster");
+    luaL_argcheck(L, to >= 0 && to <= b->C->n, 1, "invalid worker");
+    lsc_send(L, to, lua_gettop(L) - 1);
+    return 0;
+}
+
+static int Lcluster_recv(lua_State *L) {
+    cluster_box *b = (cluster_box*)lsc_state(L)->mailbox;
+    lsc_Task *t = lsc_current(L);
+    cluster_msg *m;
+    int nargs;
+    if (t == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (b == NULL || b->closed) {
+        lua_pushnil(L);
+        lua_pushstring(L, "closed");
+        return 2;
     }
-    /* setup return values */
-    lsc_emit(&joined, from, nrets);
-    assert(joined.prev == &joined);
+    if ((m = box_pop(b)) == NULL)
+        return lsc_wait(t, &b->fd->read, 0);
+    lua_pushinteger(L, m->from);
+    nargs = unpack_msg(L, m) + 1;
+    free(m);
+    return nargs;
 }
 
-LSC_API int lsc_deletetask(lsc_Task *t, lua_State *from) {
-    lsc_Status s = lsc_status(t);
-    if (s == lsc_Dead || s == lsc_Running)
-        return 0;
-    /* invalid task and wake up joined tasks */
-    wakeup_joins(t, from);
-    /* remove it from task box */
-    unregister_task(t);
-    /* mark task as dead */
-    t->L = NULL;
-    return 1;
+static int Lcluster_id(lua_State *L) {
+    cluster_box *b = (cluster_box*)lsc_state(L)->mailbox;
+    if (b == NULL) return 0;
+    lua_pushinteger(L, b->id);
+    lua_pushinteger(L, b->C->n);
+    return 2;
 }
 
-static int copy_stack(lua_State *from, lua_State *to, int n) {
-    int i;
-    luaL_checkstack(from, n, "too many args");
-    for (i = 0; i < n; ++i)
-        lua_pushvalue(from, -n);
-    if (from != to)
-        lua_xmove(from, to, n);
-    return n;
+static int Lcluster_join(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    cluster **pc = cluster_anchor(L);
+    luaL_Buffer B;
+    int i, ok = 1;
+    if (pc == NULL || *pc == NULL)
+        return luaL_error(L, "cluster not started");
+    if (S->mailbox == &(*pc)->boxes[0]) {
+        box_close(S, &(*pc)->boxes[0]);
+        S->mailbox = NULL;
+    }
+    cluster_stop(*pc);
+    luaL_buffinit(L, &B);
+    for (i = 1; i <= (*pc)->n; ++i) {
+        cluster_box *b = &(*pc)->boxes[i];
+        if (b->errmsg == NULL && i <= (*pc)->started) continue;
+        lua_pushfstring(L, "worker %d: %s\n", i,
+                b->errmsg ? b->errmsg : "not started");
+        luaL_addvalue(&B);
+        ok = 0;
+    }
+    luaL_pushresult(&B);
+    cluster_free(*pc);
+    *pc = NULL;
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_CLUSTER);
+    if (ok) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
 }
 
-LSC_API int lsc_setcontext(lua_State *L, lsc_Task *t, int nargs) {
-    lsc_Status s = lsc_status(t);
-    if (s <= 0) return 0;
-    if (lua_status(t->L) == LUA_OK) { /* initial task? */
-        int n = lua_tointeger(t->L, 1);
-        lua_settop(t->L, n == 0 ? 1 : n);
-    } else
-        lua_settop(t->L, 0);
-    return copy_stack(L, t->L, nargs);
+LSCLUA_API int luaopen_sched_cluster(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lcluster_##name }
+        ENTRY(start),
+        ENTRY(send),
+        ENTRY(recv),
+        ENTRY(id),
+        ENTRY(join),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_newlib(L, libs);
+    return 1;
 }
 
-LSC_API int lsc_getcontext(lua_State *L, lsc_Task *t) {
-    lsc_Status s = lsc_status(t);
-    if (s == lsc_Dead || s == lsc_Running)
-        return 0;
-    if (s == lsc_Error) {
-        assert(lua_isstring(t->L, -1));
-        lua_pushvalue(t->L, -1);
-        lua_xmove(t->L, L, 1);
-        return 1;
+#endif /* LSC_USE_CLUSTER */
+
+/* offload module */
+
+#ifdef LSC_USE_OFFLOAD
+
+typedef struct offload_req {
+    char *arg;          /* path, host or command */
+    char *data;         /* data to write, or result */
+    size_t len;
+    int stat, err;
+    const char *errmsg; /* error of getaddrinfo */
+} offload_req;
+
+static void req_free(offload_req *r) {
+    free(r->arg);
+    free(r->data);
+    free(r);
+}
+
+static int aux_offload(lua_State *L, lsc_Work *work, lsc_WorkDone *done, int withdata) {
+    size_t len;
+    const char *arg = luaL_checklstring(L, 1, &len);
+    const char *data = NULL;
+    lsc_Task *t = lsc_current(L);
+    offload_req *r;
+    int res;
+    if (withdata) data = luaL_checklstring(L, 2, &len);
+    if (t == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (lua_pushthread(L))
+        return luaL_error(L, "can not offload in main thread");
+    if ((r = (offload_req*)malloc(sizeof(offload_req))) == NULL)
+        return luaL_error(L, "not enough memory");
+    memset(r, 0, sizeof(offload_req));
+    r->arg = (char*)malloc(strlen(arg) + 1);
+    if (withdata) r->data = (char*)malloc(r->len = len);
+    if (r->arg == NULL || (withdata && len != 0 && r->data == NULL)) {
+        req_free(r);
+        return luaL_error(L, "not enough memory");
     }
-    if (s > 0 && lua_status(t->L) == LUA_OK) { /* initial task? */
-        int n = lua_tointeger(t->L, 1);
-        return copy_stack(t->L, L,
-                lua_gettop(t->L) - (n == 0 ? 1 : n));
+    strcpy(r->arg, arg);
+    if (withdata) memcpy(r->data, data, len);
+    lua_settop(L, 0);
+    if ((res = lsc_offload(t, work, done, r)) < 0) {
+        int err = errno;
+        req_free(r);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
     }
-    return copy_stack(t->L, L, lua_gettop(t->L));
+    return res;
 }
 
-LSC_API lsc_Status lsc_status(lsc_Task *t) {
-    if (t->L == NULL)
-        return lsc_Dead;
-    else if (t->waitat == &t->S->running)
-        return lsc_Running;
-    else if (t->waitat == &t->S->ready)
-        return lsc_Ready;
-    else if (t->waitat == &t->S->error)
-        return lsc_Error;
-    else if (!lsc_signalvalid(&t->joined))
-        return lsc_Finished;
-    else if (t->waitat == NULL)
-        return lsc_Hold;
-    return lsc_Waitting;
+static void readfile_work(void *ud) {
+    offload_req *r = (offload_req*)ud;
+    FILE *fp = fopen(r->arg, "rb");
+    size_t cap = LUAL_BUFFERSIZE;
+    if (fp == NULL) {
+        r->err = errno;
+        return;
+    }
+    r->data = (char*)malloc(cap);
+    while (r->data != NULL) {
+        char *p;
+        r->len += fread(r->data + r->len, 1, cap - r->len, fp);
+        if (r->len < cap) break;
+        if ((p = (char*)realloc(r->data, cap *= 2)) == NULL)
+            free(r->data);
+        r->data = p;
+    }
+    r->err = r->data == NULL ? ENOMEM : ferror(fp) ? errno : 0;
+    if (r->err != 0) {
+        free(r->data);
+        r->data = NULL;
+    }
+    fclose(fp);
 }
 
-LSC_API int lsc_error(lsc_Task *t, const char *errmsg) {
-    lsc_Status s = lsc_status(t);
-    if (s == lsc_Dead || s == lsc_Finished) return 0;
-    if (s == lsc_Running) return luaL_error(t->L, errmsg);
-    lua_settop(t->L, 0);
-    lua_pushstring(t->L, errmsg); /* context */
-    return queue_task(t, &t->S->error);
+static int readfile_done(lua_State *L, void *ud) {
+    offload_req *r = (offload_req*)ud;
+    int n = 0;
+    if (L != NULL && r->data != NULL) {
+        lua_pushlstring(L, r->data, r->len);
+        n = 1;
+    }
+    else if (L != NULL) {
+        errno = r->err;
+        n = luaL_fileresult(L, 0, r->arg);
+    }
+    req_free(r);
+    return n;
 }
 
-LSC_API int lsc_wait(lsc_Task *t, lsc_Signal *s, int nctx) {
-    lsc_Status stat = lsc_status(t);
-    t->waitat = s;
-    if (s == NULL) {
-        queue_removeself(&t->head);
-        lsc_initsignal(&t->head);
+static void writefile_work(void *ud) {
+    offload_req *r = (offload_req*)ud;
+    FILE *fp = fopen(r->arg, "wb");
+    r->stat = fp != NULL
+        && fwrite(r->data, 1, r->len, fp) == r->len
+        && fflush(fp) == 0;
+    r->err = errno;
+    if (fp != NULL && fclose(fp) != 0 && r->stat) {
+        r->stat = 0;
+        r->err = errno;
     }
-    else
-        queue_append(&t->head, t->waitat);
-    if (stat == lsc_Running)
-        return lua_yield(t->L, nctx);
-    return 0;
 }
 
-LSC_API int lsc_ready(lsc_Task *t, int nctx) {
-    if (lsc_status(t) == lsc_Running)
-        return 0;
-    return queue_task(t, &t->S->ready);
+static int writefile_done(lua_State *L, void *ud) {
+    offload_req *r = (offload_req*)ud;
+    int n = 0;
+    if (L != NULL) {
+        errno = r->err;
+        n = luaL_fileresult(L, r->stat, r->arg);
+    }
+    req_free(r);
+    return n;
 }
 
-LSC_API int lsc_hold(lsc_Task *t, int nctx) {
-    if (lsc_status(t) == lsc_Running)
-        return 0;
-    queue_removeself(&t->head);
-    lsc_initsignal(&t->head);
-    t->waitat = NULL;
-    return 1;
+static void execute_work(void *ud) {
+    offload_req *r = (offload_req*)ud;
+    r->stat = system(r->arg);
+    r->err = errno;
 }
 
-LSC_API int lsc_join(lsc_Task *t, lsc_Task *jointo, int nctx) {
-    lsc_Status st = lsc_status(t);
-    lsc_Status sj = lsc_status(jointo);
-    if (st == lsc_Running || sj <= 0) return 0;
-    return queue_task(t, &jointo->joined);
+static int execute_done(lua_State *L, void *ud) {
+    offload_req *r = (offload_req*)ud;
+    int n = 0;
+    if (L != NULL) {
+        errno = r->err;
+        n = luaL_execresult(L, r->stat);
+    }
+    req_free(r);
+    return n;
 }
 
-static void adjust_stack(lua_State *L, int top, int nargs) {
-    /* may faster than lua_remove? */
-    if (top > nargs) {
-        int i, removed = top - nargs;
-        for (i = 1; i <= removed; ++i) {
-            lua_pushvalue(L, removed+i);
-            lua_replace(L, i);
+static void resolve_work(void *ud) {
+    offload_req *r = (offload_req*)ud;
+    struct addrinfo hints, *res, *ai;
+    char buff[INET6_ADDRSTRLEN];
+    size_t cap = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((r->stat = getaddrinfo(r->arg, NULL, &hints, &res)) != 0) {
+        r->err = errno;
+        r->errmsg = gai_strerror(r->stat);
+        return;
+    }
+    /* result is a list of zero terminated address strings */
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        const void *addr = ai->ai_family == AF_INET6 ?
+            (const void*)&((struct sockaddr_in6*)ai->ai_addr)->sin6_addr :
+            (const void*)&((struct sockaddr_in*)ai->ai_addr)->sin_addr;
+        size_t len;
+        if (inet_ntop(ai->ai_family, addr, buff, sizeof(buff)) == NULL)
+            continue;
+        len = strlen(buff) + 1;
+        if (r->len + len > cap) {
+            char *p = (char*)realloc(r->data, cap = cap * 2 + len);
+            if (p == NULL) break;
+            r->data = p;
         }
-        lua_settop(L, nargs);
+        memcpy(r->data + r->len, buff, len);
+        r->len += len;
     }
+    freeaddrinfo(res);
 }
 
-LSC_API int lsc_wakeup(lsc_Task *t, lua_State *from, int nargs) {
-    lsc_Status s = lsc_status(t);
-    int res, top;
-    if (s <= 0) return 0;
-    queue_task(t, &t->S->running);
-    res = lua_status(t->L);
-    top = lua_gettop(t->L);
-    if (nargs < 0) { /* nargs defaults all stack values */
-        nargs = top;
-        if (res == LUA_OK)
-            --nargs; /* first run */
-    }
-    /* adjust stack to contain args only */
-    if (res != LUA_OK && res != LUA_YIELD)
-        adjust_stack(t->L, nargs, top);
-    res = lua_resume(t->L, from, nargs);
-    if (res == LUA_OK || res != LUA_YIELD) {
-        /* invaliad task and call joined tasks */
-        wakeup_joins(t, from);
-        if (res != LUA_OK) {
-            /* setup error message as context */
-            const char *errmsg = lua_tostring(t->L, -1);
-            assert(errmsg != NULL);
-            lua_settop(t->L, 0);
-            lua_pushstring(t->L, errmsg);
-            queue_task(t, &t->S->error);
-            return 0;
+static int resolve_done(lua_State *L, void *ud) {
+    offload_req *r = (offload_req*)ud;
+    int n = 0;
+    if (L != NULL && r->stat == 0) {
+        const char *p = r->data, *e = p + r->len;
+        int i = 0;
+        lua_newtable(L);
+        for (; p < e; p += strlen(p) + 1) {
+            lua_pushstring(L, p);
+            lua_rawseti(L, -2, ++i);
         }
+        n = 1;
     }
-    /* finished or wait something? */
-    assert(lsc_status(t) != lsc_Running);
+    else if (L != NULL) {
+        errno = r->err;
+        lua_pushnil(L);
+        lua_pushstring(L, r->stat == EAI_SYSTEM ?
+                strerror(r->err) : r->errmsg);
+        n = 2;
+    }
+    req_free(r);
+    return n;
+}
+
+static int Loffload_readfile(lua_State *L)
+{ return aux_offload(L, readfile_work, readfile_done, 0); }
+
+static int Loffload_writefile(lua_State *L)
+{ return aux_offload(L, writefile_work, writefile_done, 1); }
+
+static int Loffload_execute(lua_State *L)
+{ return aux_offload(L, execute_work, execute_done, 0); }
+
+static int Loffload_resolve(lua_State *L)
+{ return aux_offload(L, resolve_work, resolve_done, 0); }
+
+LSCLUA_API int luaopen_sched_offload(lua_State *L) {
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Loffload_##name }
+        ENTRY(readfile),
+        ENTRY(writefile),
+        ENTRY(execute),
+        ENTRY(resolve),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_newlib(L, libs);
     return 1;
 }
 
-LSC_API int lsc_emit(lsc_Signal *s, lua_State *from, int nargs) {
-    int n = 0;
-    lsc_Task *t;
-    lsc_Signal wait_again;
-    lsc_initsignal(&wait_again);
-    while ((t = lsc_next(s, NULL)) != NULL) {
-        assert(lsc_status(t) != lsc_Running);
-        if (from && nargs > 0)
-            lsc_setcontext(from, t, nargs);
-        lsc_wakeup(t, from, nargs);
-        if (t->waitat == s)
-            queue_append(&t->head, &wait_again);
-        ++n;
+#endif /* LSC_USE_OFFLOAD */
+
+
+/* channel module interface */
+
+/* values are kept in a ring in the uservalue table of channel, a
+ * blocked task waits on readers or writers with a continuation, and
+ * retries when it's made ready. so a consumer takes all values sent
+ * before it runs in one resume. */
+
+#define CHAN_SEND 1
+#define CHAN_RECV 2
+
+typedef struct chan_state {
+    lsc_Signal readers; /* tasks waitting for values */
+    lsc_Signal writers; /* tasks waitting for room */
+    int cap, head, count;
+    int closed;
+} chan_state;
+
+static int chan_retry(lua_State *L, int op);
+
+#if LUA_VERSION_NUM >= 503
+static int chan_k(lua_State *L, int status, lua_KContext ctx)
+{ (void)status; return chan_retry(L, (int)ctx); }
+#else
+static int chan_k(lua_State *L)
+{ int ctx = 0; lua_getctx(L, &ctx); return chan_retry(L, ctx); }
+#endif
+
+static chan_state *chan_check(lua_State *L) {
+    return (chan_state*)luaL_checkudata(L, 1, "sched.channel");
+}
+
+static int chan_closed(lua_State *L) {
+    lua_pushnil(L);
+    lua_pushstring(L, "closed");
+    return 2;
+}
+
+static void chan_readyone(lua_State *L, lsc_Signal *s) {
+    lsc_Task *t = lsc_next(s, NULL);
+    if (t != NULL) {
+        fire_task(t, s); /* for select */
+        lsc_setcontext(L, t, 0); /* nothing to pass, it retries */
+        lsc_ready(t, 0);
     }
-    queue_replace(s, &wait_again);
-    if (from && nargs > 0)
-        lua_pop(from, nargs);
+}
+
+static int chan_block(lua_State *L, lsc_Signal *s, int op) {
+    lsc_Task *t = lsc_current(L);
+    if (t == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    wait_signal(t, s);
+    return lua_yieldk(L, 0, op, chan_k);
+}
+
+static int chan_push(lua_State *L, chan_state *c) {
+    /* stack: channel, value */
+    if (c->count == c->cap) return 0;
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, (c->head + c->count++) % c->cap + 1);
+    lua_pop(L, 1);
+    chan_readyone(L, &c->readers);
+    return 1;
+}
+
+static int chan_pop(lua_State *L, chan_state *c, int idx, int n) {
+    /* push at most n values, and make room for writers */
+    int i, ud = lua_gettop(L) + 1;
+    if (n > c->count) n = c->count;
+    luaL_checkstack(L, n + 1, "too many values");
+    lua_getuservalue(L, idx);
+    for (i = 0; i < n; ++i) {
+        lua_rawgeti(L, ud, c->head + 1);
+        lua_pushnil(L);
+        lua_rawseti(L, ud, c->head + 1);
+        c->head = (c->head + 1) % c->cap;
+    }
+    lua_remove(L, ud);
+    c->count -= n;
+    for (i = 0; i < n && lsc_count(&c->writers) != 0; ++i)
+        chan_readyone(L, &c->writers);
     return n;
 }
 
+static int chan_retry(lua_State *L, int op) {
+    chan_state *c = chan_check(L);
+    lua_settop(L, 2);
+    if (op == CHAN_SEND) {
+        if (c->closed) return chan_closed(L);
+        if (!chan_push(L, c))
+            return chan_block(L, &c->writers, op);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (c->count == 0) {
+        if (c->closed) return chan_closed(L);
+        return chan_block(L, &c->readers, op);
+    }
+    return chan_pop(L, c, 1, (int)luaL_optinteger(L, 2, 1));
+}
+
+static int Lchannel_new(lua_State *L) {
+    int cap = (int)luaL_optinteger(L, 1, 1);
+    chan_state *c;
+    luaL_argcheck(L, cap > 0, 1, "capacity must be positive");
+    c = (chan_state*)lua_newuserdata(L, sizeof(chan_state));
+    lsc_initsignal(&c->readers);
+    lsc_initsignal(&c->writers);
+    c->cap = cap;
+    c->head = c->count = 0;
+    c->closed = 0;
+    luaL_setmetatable(L, "sched.channel");
+    lua_createtable(L, cap, 0);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int Lchannel_close(lua_State *L) {
+    chan_state *c = chan_check(L);
+    c->closed = 1;
+    lsc_readyall(&c->readers); /* they get "closed" when retry */
+    lsc_readyall(&c->writers);
+    return 0;
+}
 
-/* main state maintains */
+static int Lchannel_gc(lua_State *L) {
+    chan_state *c = chan_check(L);
+    lsc_deletesignal(&c->readers, L);
+    lsc_deletesignal(&c->writers, L);
+    return 0;
+}
 
-LSC_API lsc_Task *lsc_current(lua_State *L) {
-    lsc_Task *t;
-    get_taskbox(L);
-    lua_pushthread(L);
-    lua_rawget(L, -2);
-    t = (lsc_Task*)lua_touserdata(L, -1);
-    lua_pop(L, 2);
-    return t;
+static int Lchannel_send(lua_State *L) {
+    return chan_retry(L, CHAN_SEND);
 }
 
-LSC_API lsc_Task *lsc_maintask(lua_State *L) {
-    lua_State *mL;
-    lsc_State *s = lsc_state(L);
-    if (s->main) return s->main;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
-    mL = lua_tothread(L, -1);
-    assert(mL != NULL);
-    s->main = lsc_newtask(L, mL, 0);
-    lua_pop(L, 2);
-    /* main task is always treats as running */
-    queue_task(s->main, &s->running);
-    return s->main;
+static int Lchannel_recv(lua_State *L) {
+    lua_settop(L, 1);
+    return chan_retry(L, CHAN_RECV);
 }
 
-LSC_API const char *lsc_collect(lua_State *L, lsc_State *s, lsc_Collect *f, void *ud) {
-    lsc_Signal curr_error;
-    luaL_Buffer b;
-    lsc_Task *t;
-    luaL_buffinit(L, &b);
-    queue_replace(&curr_error, &s->error);
-    lsc_initsignal(&s->error);
-    while ((t = lsc_next(&curr_error, NULL)) != NULL) {
-        lua_pushfstring(L, "task(%p): ", t);
-        luaL_addvalue(&b);
-        if (f != NULL && f(t, L, ud))
-            luaL_addvalue(&b);
-        else {
-            assert(lua_isstring(t->L, -1));
-            lua_xmove(t->L, L, 1);
-            luaL_addvalue(&b);
-            lsc_deletetask(t, L);
-        }
-        if (t->L != NULL)
-            queue_append(&t->head, &s->error);
-        luaL_addchar(&b, '\n');
-    }
-    luaL_pushresult(&b);
-    return lua_tostring(L, -1);
+static int Lchannel_recvmany(lua_State *L) {
+    luaL_argcheck(L, luaL_checkinteger(L, 2) > 0, 2, "count must be positive");
+    return chan_retry(L, CHAN_RECV);
 }
 
-LSC_API void lsc_setpoll(lsc_State *s, lsc_Poll *poll, void *ud) {
-    s->poll = poll;
-    s->ud = ud;
+static int Lchannel_trysend(lua_State *L) {
+    chan_state *c = chan_check(L);
+    lua_settop(L, 2);
+    if (c->closed) return chan_closed(L);
+    lua_pushboolean(L, chan_push(L, c));
+    return 1;
 }
 
-LSC_API int lsc_once(lsc_State *s, lua_State *from) {
-    int res = 0;
-    lsc_Signal curr_ready;
-    queue_replace(&curr_ready, &s->ready);
-    lsc_initsignal(&s->ready);
-    lsc_emit(&curr_ready, from, -1);
-    assert(curr_ready.prev == &curr_ready);
-    if (s->poll != NULL)
-        res = !s->poll(s, from, s->ud);
-    if (s->error.prev != &s->error) /* has errors? */
-        return -1;
-    return res || lsc_next(&s->ready, NULL) != NULL;
+static int Lchannel_tryrecv(lua_State *L) {
+    chan_state *c = chan_check(L);
+    lua_settop(L, 1);
+    if (c->count == 0) {
+        if (c->closed) return chan_closed(L);
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, 1);
+    return chan_pop(L, c, 1, 1) + 1;
 }
 
-LSC_API int lsc_loop(lsc_State *s, lua_State *from) {
-    int res;
-    while ((res = lsc_once(s, from)) > 0)
-        ;
-    return res == 0;
+static int Lchannel_count(lua_State *L) {
+    chan_state *c = chan_check(L);
+    lua_pushinteger(L, c->count);
+    lua_pushinteger(L, c->cap);
+    return 2;
 }
 
+LSCLUA_API int luaopen_sched_channel(lua_State *L) {
+    luaL_Reg libs[] = {
+        { "__gc", Lchannel_gc },
+#define ENTRY(name) { #name, Lchannel_##name }
+        ENTRY(new),
+        ENTRY(send),
+        ENTRY(recv),
+        ENTRY(recvmany),
+        ENTRY(trysend),
+        ENTRY(tryrecv),
+        ENTRY(close),
+        ENTRY(count),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    if (luaL_newmetatable(L, "sched.channel")) {
+        luaL_setfuncs(L, libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    return 1;
+}
 
-/* lua type maintains */
 
-LSC_API lsc_Task *lsc_checktask(lua_State *L, int idx) {
-    lsc_Task *t = (lsc_Task*)luaL_checkudata(L, idx, "sched.task");
-    if (t->L == NULL)
-        luaL_argerror(L, idx, "got deleted task");
+/* sync module interface */
+
+/* a waitting task is queued in FIFO order, and the lock (or permit)
+ * is handed to it directly when released, then it's made ready. so
+ * nobody can barge in before it runs. */
+
+typedef struct sync_mutex {
+    lsc_Signal waiters;
+    lsc_Task *owner;
+} sync_mutex;
+
+typedef struct sync_semaphore {
+    lsc_Signal waiters;
+    lua_Integer count;
+} sync_semaphore;
+
+typedef struct sync_condvar {
+    lsc_Signal waiters;
+    sync_mutex *mutex; /* mutex waiters waits with */
+} sync_condvar;
+
+typedef struct sync_rwlock {
+    lsc_Signal readq;
+    lsc_Signal writeq;
+    lsc_Task *writer;
+    int readers;
+} sync_rwlock;
+
+static lsc_Task *sync_current(lua_State *L) {
+    lsc_Task *t = lsc_current(L);
+    if (t == NULL)
+        luaL_error(L, "current coroutine is not a task");
     return t;
 }
 
-LSC_API lsc_Task *lsc_testtask(lua_State *L, int idx) {
-    return (lsc_Task*)luaL_testudata(L, idx, "sched.task");
+static int sync_block(lua_State *L, lsc_Signal *s) {
+    lsc_Task *t = sync_current(L);
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    return lsc_wait(t, s, 0);
 }
 
-LSC_API int lsc_pushtask(lua_State *L, lsc_Task *t) {
-    if (t == NULL)
-        return 0;
-    get_taskbox(L);
-    lua_pushthread(t->L);
-    lua_xmove(t->L, L, 1);
-    lua_rawget(L, -2);
-    if (lua_isnil(L, -1)) {
-        lua_pop(L, 2);
-        return 0;
-    }
-    lua_remove(L, -2);
+static void sync_handoff(lua_State *L, lsc_Task *t) {
+    /* t runs at next tick, and it's lock call returns true */
+    lsc_setcontext(L, t, 0);
+    lua_pushboolean(t->L, 1);
+    lsc_ready(t, 1);
+}
+
+static void mutex_release(lua_State *L, sync_mutex *m) {
+    if ((m->owner = lsc_next(&m->waiters, NULL)) != NULL)
+        sync_handoff(L, m->owner);
+}
+
+static int Lsync_mutex(lua_State *L) {
+    sync_mutex *m = (sync_mutex*)lua_newuserdata(L, sizeof(sync_mutex));
+    lsc_initsignal(&m->waiters);
+    m->owner = NULL;
+    luaL_setmetatable(L, "sched.mutex");
     return 1;
 }
 
-LSC_API lsc_Signal *lsc_checksignal(lua_State *L, int idx) {
-    lsc_Signal *s = (lsc_Signal*)luaL_checkudata(L, idx, "sched.signal");
-    if (!lsc_signalvalid(s))
-        luaL_argerror(L, idx, "got deleted signal");
-    return s;
+static int Lmutex_lock(lua_State *L) {
+    sync_mutex *m = (sync_mutex*)luaL_checkudata(L, 1, "sched.mutex");
+    lsc_Task *t = sync_current(L);
+    if (m->owner == t)
+        return luaL_error(L, "mutex already locked by current task");
+    if (m->owner != NULL)
+        return sync_block(L, &m->waiters);
+    m->owner = t;
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
-LSC_API lsc_Signal *lsc_testsignal(lua_State *L, int idx) {
-    return (lsc_Signal*)luaL_testudata(L, idx, "sched.signal");
+static int Lmutex_trylock(lua_State *L) {
+    sync_mutex *m = (sync_mutex*)luaL_checkudata(L, 1, "sched.mutex");
+    lsc_Task *t = sync_current(L);
+    if (m->owner == NULL)
+        m->owner = t;
+    lua_pushboolean(L, m->owner == t);
+    return 1;
 }
 
+static int Lmutex_unlock(lua_State *L) {
+    sync_mutex *m = (sync_mutex*)luaL_checkudata(L, 1, "sched.mutex");
+    if (m->owner != sync_current(L))
+        return luaL_error(L, "mutex not locked by current task");
+    mutex_release(L, m);
+    return 0;
+}
 
-/* signal module interface */
+static int Lsync_semaphore(lua_State *L) {
+    lua_Integer n = luaL_optinteger(L, 1, 0);
+    sync_semaphore *sem;
+    luaL_argcheck(L, n >= 0, 1, "negative count");
+    sem = (sync_semaphore*)lua_newuserdata(L, sizeof(sync_semaphore));
+    lsc_initsignal(&sem->waiters);
+    sem->count = n;
+    luaL_setmetatable(L, "sched.semaphore");
+    return 1;
+}
 
-static int Lsignal_new(lua_State *L) {
-    lsc_newsignal(L, 0);
+static int Lsemaphore_acquire(lua_State *L) {
+    sync_semaphore *sem =
+        (sync_semaphore*)luaL_checkudata(L, 1, "sched.semaphore");
+    if (sem->count == 0)
+        return sync_block(L, &sem->waiters);
+    --sem->count;
+    lua_pushboolean(L, 1);
     return 1;
 }
 
-static int Lsignal_delete(lua_State *L) {
-    lsc_Signal *s = lsc_testsignal(L, 1);
-    if (s != NULL) lsc_deletesignal(s, L);
+static int Lsemaphore_tryacquire(lua_State *L) {
+    sync_semaphore *sem =
+        (sync_semaphore*)luaL_checkudata(L, 1, "sched.semaphore");
+    lua_pushboolean(L, sem->count != 0);
+    if (sem->count != 0) --sem->count;
+    return 1;
+}
+
+static int Lsemaphore_release(lua_State *L) {
+    sync_semaphore *sem =
+        (sync_semaphore*)luaL_checkudata(L, 1, "sched.semaphore");
+    lua_Integer n = luaL_optinteger(L, 2, 1);
+    lsc_Task *t;
+    luaL_argcheck(L, n > 0, 2, "count must be positive");
+    for (; n > 0 && (t = lsc_next(&sem->waiters, NULL)) != NULL; --n)
+        sync_handoff(L, t);
+    sem->count += n;
     return 0;
 }
 
-static int Lsignal_tostring(lua_State *L) {
-    lsc_Signal *s = lsc_testsignal(L, 1);
-    if (s == NULL)
-        luaL_tolstring(L, -1, NULL);
-    else if (!lsc_signalvalid(s))
-        lua_pushfstring(L, "sched.signal(deleted): %p", s);
-    else
-        lua_pushfstring(L, "sched.signal: %p", s);
+static int Lsemaphore_count(lua_State *L) {
+    sync_semaphore *sem =
+        (sync_semaphore*)luaL_checkudata(L, 1, "sched.semaphore");
+    lua_pushinteger(L, sem->count);
     return 1;
 }
 
-static int Lsignal_emit(lua_State *L) {
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    int top = lua_gettop(L) - 1;
-    lua_pushboolean(L, lsc_emit(s, L, top == 0 ? -1 : top));
+static int Lsync_condvar(lua_State *L) {
+    sync_condvar *cv =
+        (sync_condvar*)lua_newuserdata(L, sizeof(sync_condvar));
+    lsc_initsignal(&cv->waiters);
+    cv->mutex = NULL;
+    luaL_setmetatable(L, "sched.condvar");
     return 1;
 }
 
-static int Lsignal_ready(lua_State *L) {
-    lsc_Task *t;
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    int top = lua_gettop(L) - 1;
-    while ((t = lsc_next(s, NULL)) != NULL) {
-        lsc_setcontext(L, t, top);
-        lsc_ready(t, top);
-        assert(t->waitat != s);
+static int Lcondvar_wait(lua_State *L) {
+    sync_condvar *cv =
+        (sync_condvar*)luaL_checkudata(L, 1, "sched.condvar");
+    sync_mutex *m = (sync_mutex*)luaL_checkudata(L, 2, "sched.mutex");
+    lsc_Task *t = sync_current(L);
+    if (m->owner != t)
+        return luaL_error(L, "mutex not locked by current task");
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    if (lsc_count(&cv->waiters) != 0 && cv->mutex != m)
+        return luaL_error(L, "condvar waited with another mutex");
+    cv->mutex = m;
+    lua_settop(L, 2); /* mutex is anchored by stack when waitting */
+    mutex_release(L, m);
+    return lsc_wait(t, &cv->waiters, 0);
+}
+
+static int cond_wake(lua_State *L, sync_condvar *cv) {
+    /* move a waiter to mutex, it returns when the mutex is got */
+    lsc_Task *t = lsc_next(&cv->waiters, NULL);
+    if (t == NULL) return 0;
+    if (cv->mutex->owner == NULL) {
+        cv->mutex->owner = t;
+        sync_handoff(L, t);
     }
+    else
+        lsc_wait(t, &cv->mutex->waiters, 0);
     return 1;
 }
 
-static int Lsignal_one(lua_State *L) {
-    lsc_Task *t;
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    int top = lua_gettop(L) - 1;
-    if ((t = lsc_next(s, NULL)) != NULL) {
-        lsc_setcontext(L, t, top);
-        lsc_wakeup(t, L, top);
-    }
+static int Lcondvar_signal(lua_State *L) {
+    cond_wake(L, (sync_condvar*)luaL_checkudata(L, 1, "sched.condvar"));
+    return 0;
+}
+
+static int Lcondvar_broadcast(lua_State *L) {
+    sync_condvar *cv =
+        (sync_condvar*)luaL_checkudata(L, 1, "sched.condvar");
+    while (cond_wake(L, cv))
+        ;
+    return 0;
+}
+
+static int Lsync_rwlock(lua_State *L) {
+    sync_rwlock *rw = (sync_rwlock*)lua_newuserdata(L, sizeof(sync_rwlock));
+    lsc_initsignal(&rw->readq);
+    lsc_initsignal(&rw->writeq);
+    rw->writer = NULL;
+    rw->readers = 0;
+    luaL_setmetatable(L, "sched.rwlock");
     return 1;
 }
 
-static int Lsignal_filter(lua_State *L) {
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    lsc_Task *t = lsc_next(s, NULL);
-    lua_settop(L, 2);
-    while (t != NULL) {
-        int n;
-        lsc_Task *next = lsc_next(s, t);
-        lua_pushvalue(L, -1);
-        lsc_pushtask(L, t);
-        n = lsc_getcontext(L, t) + 1;
-        lua_call(L, n, 0);
-        t = next;
+static void rwlock_release(lua_State *L, sync_rwlock *rw) {
+    /* writers first, then all readers waitting */
+    lsc_Task *t;
+    if ((rw->writer = lsc_next(&rw->writeq, NULL)) != NULL) {
+        sync_handoff(L, rw->writer);
+        return;
     }
-    lua_settop(L, 1);
+    while ((t = lsc_next(&rw->readq, NULL)) != NULL) {
+        ++rw->readers;
+        sync_handoff(L, t);
+    }
+}
+
+static int Lrwlock_rlock(lua_State *L) {
+    sync_rwlock *rw = (sync_rwlock*)luaL_checkudata(L, 1, "sched.rwlock");
+    if (rw->writer != NULL || lsc_count(&rw->writeq) != 0)
+        return sync_block(L, &rw->readq);
+    ++rw->readers;
+    lua_pushboolean(L, 1);
     return 1;
 }
 
-static int Lsignal_next(lua_State *L) {
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    lsc_Task *t = lua_isnoneornil(L, 2) ? NULL :
-        lsc_checktask(L, 2);
-    return lsc_pushtask(L, lsc_next(s, t));
+static int Lrwlock_runlock(lua_State *L) {
+    sync_rwlock *rw = (sync_rwlock*)luaL_checkudata(L, 1, "sched.rwlock");
+    if (rw->readers == 0)
+        return luaL_error(L, "rwlock not locked for reading");
+    if (--rw->readers == 0)
+        rwlock_release(L, rw);
+    return 0;
 }
 
-static int Lsignal_count(lua_State *L) {
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    lua_pushinteger(L, lsc_count(s));
+static int Lrwlock_wlock(lua_State *L) {
+    sync_rwlock *rw = (sync_rwlock*)luaL_checkudata(L, 1, "sched.rwlock");
+    lsc_Task *t = sync_current(L);
+    if (rw->writer == t)
+        return luaL_error(L, "rwlock already locked by current task");
+    if (rw->writer != NULL || rw->readers != 0)
+        return sync_block(L, &rw->writeq);
+    rw->writer = t;
+    lua_pushboolean(L, 1);
     return 1;
 }
 
-static int Lsignal_index(lua_State *L) {
-    lsc_Signal *s = lsc_checksignal(L, 1);
-    lua_Integer idx = luaL_optinteger(L, 2, 1);
-    if (idx > 0) --idx;
-    return lsc_pushtask(L, lsc_index(s, (int)idx));
+static int Lrwlock_wunlock(lua_State *L) {
+    sync_rwlock *rw = (sync_rwlock*)luaL_checkudata(L, 1, "sched.rwlock");
+    if (rw->writer != sync_current(L))
+        return luaL_error(L, "rwlock not locked by current task");
+    rwlock_release(L, rw);
+    return 0;
 }
 
-LSCLUA_API int luaopen_sched_signal(lua_State *L) {
-    luaL_Reg libs[] = {
-        { "__gc", Lsignal_delete },
-        { "__tostring", Lsignal_tostring },
-#define ENTRY(name) { #name, Lsignal_##name }
-        ENTRY(new),
-        ENTRY(delete),
-        ENTRY(emit),
-        ENTRY(ready),
-        ENTRY(one),
-        ENTRY(filter),
-        ENTRY(next),
+static void sync_newmeta(lua_State *L, const char *name, const luaL_Reg *l) {
+    if (luaL_newmetatable(L, name)) {
+        luaL_setfuncs(L, l, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+}
+
+LSCLUA_API int luaopen_sched_sync(lua_State *L) {
+    luaL_Reg mutex[] = {
+#define ENTRY(name) { #name, Lmutex_##name }
+        ENTRY(lock),
+        ENTRY(trylock),
+        ENTRY(unlock),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg semaphore[] = {
+#define ENTRY(name) { #name, Lsemaphore_##name }
+        ENTRY(acquire),
+        ENTRY(tryacquire),
+        ENTRY(release),
         ENTRY(count),
-        ENTRY(index),
 #undef  ENTRY
         { NULL, NULL }
     };
-    if (luaL_newmetatable(L, "sched.signal")) {
-        luaL_setfuncs(L, libs, 0);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, -2, "__index");
+    luaL_Reg condvar[] = {
+#define ENTRY(name) { #name, Lcondvar_##name }
+        ENTRY(wait),
+        ENTRY(signal),
+        ENTRY(broadcast),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg rwlock[] = {
+#define ENTRY(name) { #name, Lrwlock_##name }
+        ENTRY(rlock),
+        ENTRY(runlock),
+        ENTRY(wlock),
+        ENTRY(wunlock),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg libs[] = {
+#define ENTRY(name) { #name, Lsync_##name }
+        ENTRY(mutex),
+        ENTRY(semaphore),
+        ENTRY(condvar),
+        ENTRY(rwlock),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    sync_newmeta(L, "sched.mutex", mutex);
+    sync_newmeta(L, "sched.semaphore", semaphore);
+    sync_newmeta(L, "sched.condvar", condvar);
+    sync_newmeta(L, "sched.rwlock", rwlock);
+    luaL_newlib(L, libs);
+    return 1;
+}
+
+
+/* future module interface */
+
+/* values (or error) of a settled future are kept in it's uservalue
+ * table, with callbacks added by `andthen` in field "cb", as triples
+ * of next future, handler of value and of error. a combinator adds
+ * the index of source as handler, and counts sources left itself. */
+
+#define FUTURE_PENDING  0
+#define FUTURE_RESOLVED 1
+#define FUTURE_REJECTED 2
+
+#define FUTURE_ALL 1
+#define FUTURE_ANY 2
+
+typedef struct future_state {
+    lsc_Signal waiters; /* tasks in await() */
+    int status;
+    int n;      /* count of values */
+    int kind;   /* combinator kind, or 0 */
+    int remain; /* sources not settled of combinator */
+} future_state;
+
+static future_state *future_check(lua_State *L, int idx) {
+    return (future_state*)luaL_checkudata(L, idx, "sched.future");
+}
+
+static future_state *future_new(lua_State *L, int kind) {
+    future_state *f =
+        (future_state*)lua_newuserdata(L, sizeof(future_state));
+    lsc_initsignal(&f->waiters);
+    f->status = FUTURE_PENDING;
+    f->n = 0;
+    f->kind = kind;
+    f->remain = 0;
+    luaL_setmetatable(L, "sched.future");
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+    return f;
+}
+
+static int future_push(lua_State *L, int idx, future_state *f) {
+    int i;
+    luaL_checkstack(L, f->n + 1, "too many values");
+    lua_getuservalue(L, idx);
+    for (i = 1; i <= f->n; ++i)
+        lua_rawgeti(L, -i, i);
+    lua_remove(L, -f->n - 1);
+    return f->n;
+}
+
+static int future_store(lua_State *L, int idx, int status, int first, int n) {
+    /* settle future at idx with values at first, wake tasks awaiting
+     * it, but leave callbacks to future_settle() */
+    future_state *f = (future_state*)lua_touserdata(L, idx);
+    int i;
+    if (f->status != FUTURE_PENDING) return 0;
+    lua_getuservalue(L, idx);
+    for (i = 0; i < n; ++i) {
+        lua_pushvalue(L, first + i);
+        lua_rawseti(L, -2, i + 1);
     }
+    lua_pop(L, 1);
+    f->status = status;
+    f->n = n;
+    lsc_readyall(&f->waiters); /* they get values when run */
     return 1;
 }
 
+static int future_combine(lua_State *L, int g, int index, int src) {
+    /* source future at src settled, it's the index-th of g */
+    future_state *c = (future_state*)lua_touserdata(L, g);
+    future_state *f = (future_state*)lua_touserdata(L, src);
+    int n, top = lua_gettop(L), settled = 0;
+    if (c->status != FUTURE_PENDING) return 0;
+    if (c->kind == FUTURE_ALL && f->status == FUTURE_RESOLVED) {
+        lua_getuservalue(L, g);
+        lua_rawgeti(L, -1, 1); /* results */
+        future_push(L, src, f);
+        lua_settop(L, top + 3); /* first value only */
+        lua_rawseti(L, -2, index);
+        if (--c->remain == 0)
+            settled = future_store(L, g, FUTURE_RESOLVED, top + 2, 1);
+    }
+    else if (c->kind == FUTURE_ANY && f->status == FUTURE_REJECTED) {
+        if (--c->remain == 0) {
+            n = future_push(L, src, f);
+            settled = future_store(L, g, FUTURE_REJECTED, top + 1, n);
+        }
+    }
+    else { /* the first error of all, or the first value of any */
+        if (c->kind == FUTURE_ANY) lua_pushinteger(L, index);
+        future_push(L, src, f);
+        settled = future_store(L, g, f->status, top + 1,
+                lua_gettop(L) - top);
+    }
+    lua_settop(L, top);
+    return settled;
+}
 
-/* task module interface */
-
-static int Ltask_new(lua_State *L) {
-    lua_State *coro;
-    int top = lua_gettop(L);
-    luaL_checktype(L, 1, LUA_TFUNCTION);
-    coro = lua_newthread(L);
-    lsc_ready(lsc_newtask(L, coro, 0), 0);
-    lua_insert(L, 1);
-    lua_pop(L, 1); /* remove coroutine */
-    lua_xmove(L, coro, top);
-    assert(lua_gettop(L) == 1);
-    return 1;
+static int future_fire(lua_State *L, int src, int g, int h) {
+    /* run handler at h for settled future at src, and settle future
+     * at g with its results, returns whether g settled */
+    future_state *f = (future_state*)lua_touserdata(L, src);
+    int n, top = lua_gettop(L), settled;
+    if (lua_isnumber(L, h))
+        return future_combine(L, g, (int)lua_tointeger(L, h), src);
+    if (!lua_toboolean(L, h)) { /* no handler, pass it through */
+        n = future_push(L, src, f);
+        settled = future_store(L, g, f->status, top + 1, n);
+    }
+    else {
+        lua_pushvalue(L, h);
+        n = future_push(L, src, f);
+        if (lua_pcall(L, n, LUA_MULTRET, 0) == LUA_OK)
+            settled = future_store(L, g, FUTURE_RESOLVED, top + 1,
+                    lua_gettop(L) - top);
+        else
+            settled = future_store(L, g, FUTURE_REJECTED, top + 1, 1);
+    }
+    lua_settop(L, top);
+    return settled;
 }
 
-static int Ltask_delete(lua_State *L) {
-    lsc_Task *t = lsc_testtask(L, 1);
-    if (t != NULL)
-        lsc_deletetask(t, L);
-    return 0;
+static int future_takecb(lua_State *L, int idx) {
+    /* push callbacks of future at idx and clear them, or push nothing
+     * if it has none */
+    lua_getuservalue(L, idx);
+    lua_getfield(L, -1, "cb");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return 0;
+    }
+    lua_pushnil(L);
+    lua_setfield(L, -3, "cb");
+    lua_remove(L, -2);
+    return 1;
 }
 
-static int Ltask_tostring(lua_State *L) {
-    lsc_Task *t = lsc_testtask(L, 1);
-    if (t == NULL)
-        luaL_tolstring(L, -1, NULL);
-    else {
-        const char *s;
-        switch (lsc_status(t)) {
-        case lsc_Finished: s = "finish"; break;
-        case lsc_Error:    s = "error";  break;
-        case lsc_Dead:     s = "dead";   break;
-        default:           s = NULL;     break;
+static void future_settle(lua_State *L, int idx, int status, int first, int n) {
+    /* callbacks are run with a queue of futures settled, so a long
+     * chain of futures does not nest C calls */
+    int i, len, q, head = 1, tail = 1;
+    if (!future_store(L, idx, status, first, n)) return;
+    lua_createtable(L, 4, 0);
+    q = lua_gettop(L);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, q, 1);
+    while (head <= tail) {
+        lua_rawgeti(L, q, head); /* q+1: future settled */
+        lua_pushnil(L);
+        lua_rawseti(L, q, head++);
+        status = ((future_state*)lua_touserdata(L, q + 1))->status;
+        if (future_takecb(L, q + 1)) { /* q+2 */
+            len = (int)lua_rawlen(L, q + 2);
+            for (i = 1; i + 2 <= len; i += 3) {
+                lua_rawgeti(L, q + 2, i);
+                lua_rawgeti(L, q + 2, i + 1);
+                lua_rawgeti(L, q + 2, i + 2);
+                if (future_fire(L, q + 1, q + 3,
+                            status == FUTURE_RESOLVED ? q + 4 : q + 5)) {
+                    lua_pushvalue(L, q + 3);
+                    lua_rawseti(L, q, ++tail);
+                }
+                lua_settop(L, q + 2);
+            }
         }
-        if (s != NULL)
-            lua_pushfstring(L, "sched.task(%s): %p", s, t);
-        else
-            lua_pushfstring(L, "sched.task: %p", t);
+        lua_settop(L, q);
     }
-    return 1;
+    lua_settop(L, q - 1);
 }
 
-static lsc_Task *default_task(lua_State *L, int *parg) {
-    int arg = 2;
-    lsc_Task *t = lsc_testtask(L, 1);
-    if (t == NULL) {
-        arg = 1; 
-        t = lsc_current(L);
+static void future_listen(lua_State *L, int src, int g, int ok, int err) {
+    /* run handlers when future at src settled, at once if it's
+     * already settled */
+    future_state *f = (future_state*)lua_touserdata(L, src);
+    int len;
+    if (f->status != FUTURE_PENDING) {
+        future_fire(L, src, g, f->status == FUTURE_RESOLVED ? ok : err);
+        return;
     }
-    if (t == NULL)
-        luaL_error(L, "current coroutine is not a task");
-    if (parg) *parg = arg;
-    return t;
+    lua_getuservalue(L, src);
+    lua_getfield(L, -1, "cb");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, "cb");
+    }
+    len = (int)lua_rawlen(L, -1);
+    lua_pushvalue(L, g);
+    lua_rawseti(L, -2, len + 1);
+    /* false for no handler, keeps it a sequence */
+    if (lua_isnil(L, ok)) lua_pushboolean(L, 0);
+    else lua_pushvalue(L, ok);
+    lua_rawseti(L, -2, len + 2);
+    if (lua_isnil(L, err)) lua_pushboolean(L, 0);
+    else lua_pushvalue(L, err);
+    lua_rawseti(L, -2, len + 3);
+    lua_pop(L, 2);
 }
 
-static int Ltask_wait(lua_State *L) {
-    int arg, top = lua_gettop(L);
-    lsc_Task *t = default_task(L, &arg);
-    lsc_Signal *s = lsc_checksignal(L, arg);
-    lsc_wait(t, s, top - arg);
-    lua_settop(L, 1);
+static int Lfuture_new(lua_State *L) {
+    future_new(L, 0);
     return 1;
 }
 
-static int Ltask_ready(lua_State *L) {
-    int arg, top = lua_gettop(L);
-    lsc_Task *t = default_task(L, &arg);
-    lsc_ready(t, top - arg);
-    lua_settop(L, 1);
+static int Lfuture_resolve(lua_State *L) {
+    future_state *f = future_check(L, 1);
+    int pending = f->status == FUTURE_PENDING;
+    future_settle(L, 1, FUTURE_RESOLVED, 2, lua_gettop(L) - 1);
+    lua_pushboolean(L, pending);
     return 1;
 }
 
-static int Ltask_hold(lua_State *L) {
-    int arg, top = lua_gettop(L);
-    lsc_Task *t = default_task(L, &arg);
-    lsc_hold(t, top - arg);
-    lua_settop(L, 1);
+static int Lfuture_reject(lua_State *L) {
+    future_state *f = future_check(L, 1);
+    int pending = f->status == FUTURE_PENDING;
+    luaL_checkany(L, 2);
+    future_settle(L, 1, FUTURE_REJECTED, 2, 1);
+    lua_pushboolean(L, pending);
     return 1;
 }
 
-static int Ltask_wakeup(lua_State *L) {
-    int res, top = lua_gettop(L) - 1;
-    lsc_Task *t = lsc_checktask(L, 1);
-    lsc_Status s;
-    if (top != 0) { /* replace context? */
-        if (lua_status(t->L) == LUA_OK) /* first run? */
-            lua_settop(t->L, 1); /* clear original context */
-        lua_xmove(L, t->L, top);
+static int future_k(lua_State *L);
+
+#if LUA_VERSION_NUM >= 503
+static int future_awaitk(lua_State *L, int status, lua_KContext ctx)
+{ (void)status; (void)ctx; return future_k(L); }
+#else
+static int future_awaitk(lua_State *L)
+{ return future_k(L); }
+#endif
+
+static int future_k(lua_State *L) {
+    future_state *f = future_check(L, 1);
+    lsc_Task *t;
+    lua_settop(L, 1);
+    if (f->status == FUTURE_RESOLVED)
+        return future_push(L, 1, f);
+    if (f->status == FUTURE_REJECTED) {
+        future_push(L, 1, f);
+        return lua_error(L);
     }
-    lsc_wakeup(t, L, top == 0 ? -1 : top);
-    s = lsc_status(t);
-    assert(s != lsc_Running && s != lsc_Dead);
-    lua_pushboolean(L, s != lsc_Error);
-    res = lsc_getcontext(L, t) + 1;
-    if (s == lsc_Finished)
-        lsc_deletetask(t, L);
-    return res;
+    if ((t = lsc_current(L)) == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    wait_signal(t, &f->waiters);
+    return lua_yieldk(L, 0, 0, future_awaitk);
 }
 
-static int Ltask_context(lua_State *L) {
-    int top = lua_gettop(L) - 1;
-    lsc_Task *t = lsc_checktask(L, 1);
-    if (lsc_status(t) == lsc_Running)
-        return 0;
-    if (top > 0) { /* set context */
-        lua_settop(t->L, 0);
-        lua_xmove(L, t->L, top);
-        lua_settop(L, 1);
-        return 1;
-    }
-    return lsc_getcontext(L, t);
+static int Lfuture_await(lua_State *L) {
+    return future_k(L);
 }
 
-static int Ltask_join(lua_State *L) {
-    lsc_Task *t, *jointo;
-    int top = lua_gettop(L);
-    t = lsc_checktask(L, 1);
-    if (top == 1) {
-        jointo = t;
-        t = lsc_current(L);
-    }
-    else
-        jointo = lsc_checktask(L, 2);
-    lua_pushboolean(L, lsc_join(t, jointo, -1));
+static int Lfuture_status(lua_State *L) {
+    static const char *names[] = { "pending", "resolved", "rejected" };
+    lua_pushstring(L, names[future_check(L, 1)->status]);
     return 1;
 }
 
-static int Ltask_status(lua_State *L) {
-    lsc_Task *t = default_task(L, NULL);
-    const char *s = NULL;
-    switch (lsc_status(t)) {
-    case lsc_Finished: s = "finish";   break;
-    case lsc_Error:    s = "error";    break;
-    case lsc_Dead:     s = "dead";     break;
-    case lsc_Running:  s = "running";  break;
-    case lsc_Waitting: s = "waitting"; break;
-    case lsc_Hold:     s = "hold";     break;
-    case lsc_Ready:    s = "ready";    break;
+static int Lfuture_andthen(lua_State *L) {
+    future_check(L, 1);
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+    future_new(L, 0);
+    future_listen(L, 1, 4, 2, 3);
+    return 1;
+}
+
+static int future_combinator(lua_State *L, int kind) {
+    future_state *c;
+    int i, n;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    n = (int)lua_rawlen(L, 1);
+    for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 1, i);
+        future_check(L, -1);
+        lua_pop(L, 1);
+    }
+    c = future_new(L, kind); /* 2 */
+    c->remain = n;
+    if (kind == FUTURE_ALL) {
+        lua_getuservalue(L, 2);
+        lua_createtable(L, n, 0);
+        lua_rawseti(L, -2, 1);
+        lua_pop(L, 1);
+    }
+    if (n == 0) {
+        if (kind == FUTURE_ALL) {
+            lua_createtable(L, 0, 0);
+            future_settle(L, 2, FUTURE_RESOLVED, 3, 1);
+        } else {
+            lua_pushstring(L, "no futures");
+            future_settle(L, 2, FUTURE_REJECTED, 3, 1);
+        }
+        lua_settop(L, 2);
+        return 1;
+    }
+    for (i = 1; i <= n && c->status == FUTURE_PENDING; ++i) {
+        lua_rawgeti(L, 1, i); /* 3 */
+        lua_pushinteger(L, i); /* 4 */
+        future_listen(L, 3, 2, 4, 4);
+        lua_settop(L, 2);
     }
-    lua_pushstring(L, s);
     return 1;
 }
 
-LSCLUA_API int luaopen_sched_task(lua_State *L) {
+static int Lfuture_all(lua_State *L) {
+    return future_combinator(L, FUTURE_ALL);
+}
+
+static int Lfuture_any(lua_State *L) {
+    return future_combinator(L, FUTURE_ANY);
+}
+
+LSCLUA_API int luaopen_sched_future(lua_State *L) {
     luaL_Reg libs[] = {
-        { "__gc", Ltask_delete },
-        { "__tostring", Ltask_tostring },
-#define ENTRY(name) { #name, Ltask_##name }
+#define ENTRY(name) { #name, Lfuture_##name }
         ENTRY(new),
-        ENTRY(delete),
-        ENTRY(wait),
-        ENTRY(ready),
-        ENTRY(hold),
-        ENTRY(wakeup),
-        ENTRY(context),
-        ENTRY(join),
+        ENTRY(resolve),
+        ENTRY(reject),
+        ENTRY(await),
         ENTRY(status),
+        ENTRY(andthen),
+        ENTRY(all),
+        ENTRY(any),
 #undef  ENTRY
         { NULL, NULL }
     };
-    if (luaL_newmetatable(L, "sched.task")) {
+    if (luaL_newmetatable(L, "sched.future")) {
         luaL_setfuncs(L, libs, 0);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
@@ -1149,9 +5280,17 @@ typedef struct poll_ctx {
 
 static int aux_poll(lsc_State *s, lua_State *from, void *ud) {
     poll_ctx *ctx = (poll_ctx*)ud;
+    int res;
     lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->ref);
-    lua_call(ctx->L, 0, 0);
-    return 0;
+    lua_call(ctx->L, 0, 1);
+    res = lua_toboolean(ctx->L, -1);
+    lua_pop(ctx->L, 1);
+#ifdef LSC_USE_EPOLL
+    /* chain the I/O backend, see `io_init` */
+    if (s->io != NULL && lsc_iopoll(s, from, NULL))
+        res = 1;
+#endif
+    return res;
 }
 
 static int Lsetpoll(lua_State *L) {
@@ -1168,16 +5307,35 @@ static int Lsetpoll(lua_State *L) {
         return ret;
     }
     ctx = (poll_ctx*)lua_newuserdata(L, sizeof(poll_ctx));
-    ctx->L = L;
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LSC_POLL_CTX);
+    ctx->L = s->main->L; /* L may be a task collected later */
     lua_pushvalue(L, 1);
     ctx->ref = luaL_ref(L, LUA_REGISTRYINDEX);
     lsc_setpoll(s, aux_poll, ctx);
     return 0;
 }
 
+static void aux_budget(lua_State *L, int idx, size_t *tasks, lsc_Clock *ns) {
+    lua_Number sec;
+    *tasks = 0, *ns = 0;
+    if (lua_isnoneornil(L, idx))
+        return;
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "budget");
+    *tasks = (size_t)luaL_optinteger(L, -1, 0);
+    lua_getfield(L, idx, "time");
+    sec = luaL_optnumber(L, -1, 0);
+    *ns = sec > 0 ? (lsc_Clock)(sec * 1e9) : 0;
+    lua_pop(L, 2);
+}
+
 static int Lonce(lua_State *L) {
     lsc_State *s = lsc_state(L);
-    int res = lsc_once(s, L);
+    size_t tasks;
+    lsc_Clock ns;
+    int res;
+    aux_budget(L, 1, &tasks, &ns);
+    res = lsc_oncex(s, L, tasks, ns);
     if (res >= 0)
         lua_pushboolean(L, res);
     else
@@ -1186,9 +5344,233 @@ static int Lonce(lua_State *L) {
 }
 
 static int Lloop(lua_State *L) {
-    lua_pushboolean(L, lsc_loop(lsc_state(L), L));
+    lsc_State *s = lsc_state(L);
+    size_t tasks;
+    lsc_Clock ns;
+    int res;
+    aux_budget(L, 1, &tasks, &ns);
+    while ((res = lsc_oncex(s, L, tasks, ns)) > 0)
+        idle_wait(s);
+    lua_pushboolean(L, res == 0);
+    return 1;
+}
+
+static int Lsleep(lua_State *L) {
+    lsc_Task *t = lsc_current(L);
+    lsc_Time deadline = aux_deadline(L, 1);
+    if (t == NULL)
+        luaL_error(L, "current coroutine is not a task");
+    return lsc_waitfor(t, NULL, deadline, 0);
+}
+
+static int select_ready(lua_State *L, int i) {
+    /* stack: cases, case i. push results if case i is a channel can
+     * be received now */
+    chan_state *c = (chan_state*)luaL_testudata(L, 2, "sched.channel");
+    if (c == NULL || (c->count == 0 && !c->closed))
+        return 0;
+    lua_pushinteger(L, i);
+    if (c->count == 0) return chan_closed(L) + 1;
+    return chan_pop(L, c, 2, 1) + 1;
+}
+
+static int select_wait(lua_State *L);
+
+static int select_resume(lua_State *L) {
+    /* stack: cases, index of fired case (nil if waked up by other
+     * ways), args passed to wakeup. the index is pushed only if still
+     * waitting on cases, so check the fired index of task out of band,
+     * args may be numbers too */
+    int nres, i = lsc_state(L)->fired;
+    if (i < 0) { /* waitting changed, e.g. hold, nothing pushed */
+        lua_pushnil(L);
+        lua_insert(L, 2);
+    }
+    if (i <= 0) return lua_gettop(L) - 1;
+    lua_rawgeti(L, 1, i);
+    if (luaL_testudata(L, -1, "sched.channel") == NULL) {
+        lua_pop(L, 1); /* signal emitted */
+        return lua_gettop(L) - 1;
+    }
+    lua_replace(L, 2);
+    lua_settop(L, 2);
+    if ((nres = select_ready(L, i)) != 0)
+        return nres;
+    return select_wait(L); /* taken by others, wait again */
+}
+
+#if LUA_VERSION_NUM >= 503
+static int select_k(lua_State *L, int status, lua_KContext ctx)
+{ (void)status; (void)ctx; return select_resume(L); }
+#else
+static int select_k(lua_State *L)
+{ return select_resume(L); }
+#endif
+
+static int select_wait(lua_State *L) {
+    lsc_Signal *buff[LUA_MINSTACK], **signals = buff;
+    lsc_Task *t = lsc_current(L);
+    int i, nres, n = (int)lua_rawlen(L, 1);
+    lua_settop(L, 1);
+    for (i = 1; i <= n; ++i) { /* the first ready channel wins */
+        lua_rawgeti(L, 1, i);
+        if ((nres = select_ready(L, i)) != 0)
+            return nres;
+        lua_pop(L, 1);
+    }
+    if (n > LUA_MINSTACK)
+        signals = (lsc_Signal**)lua_newuserdata(L, n * sizeof(lsc_Signal*));
+    for (i = 0; i < n; ++i) {
+        chan_state *c;
+        lua_rawgeti(L, 1, i + 1);
+        if ((c = (chan_state*)luaL_testudata(L, -1, "sched.channel")))
+            signals[i] = &c->readers;
+        else if ((signals[i] = lsc_testsignal(L, -1)) == NULL)
+            return luaL_error(L, "case %d is not a signal or channel", i + 1);
+        lua_pop(L, 1);
+    }
+    if (t == NULL)
+        return luaL_error(L, "current coroutine is not a task");
+    if (t == t->S->main)
+        return luaL_error(L, "attempt to block the main task");
+    wait_any(t, signals, n);
+    lua_settop(L, 1);
+    return lua_yieldk(L, 0, 0, select_k);
+}
+
+static int Lselect(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, lua_rawlen(L, 1) > 0, 1, "no cases");
+    lua_settop(L, 1);
+    return select_wait(L);
+}
+
+static int Lnow(lua_State *L) {
+    lua_pushnumber(L, (lua_Number)lsc_now() / 1000);
+    return 1;
+}
+
+static int Lquota(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    int prio = (int)luaL_checkinteger(L, 1);
+    luaL_argcheck(L, prio >= 0 && prio < LSC_PRIORITIES, 1,
+            "invalid priority");
+    if (lua_isnoneornil(L, 2))
+        lua_pushinteger(L, S->quota[prio]);
+    else
+        lua_pushinteger(L, lsc_setquota(S, prio,
+                    (int)luaL_checkinteger(L, 2)));
+    return 1;
+}
+
+static int Lnexttimeout(lua_State *L) {
+    int ms = lsc_nexttimeout(lsc_state(L));
+    if (ms < 0) return 0;
+    lua_pushnumber(L, (lua_Number)ms / 1000);
+    return 1;
+}
+
+static int Lspin(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    unsigned long old = S->spin;
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Number sec = luaL_checknumber(L, 1);
+        lsc_setspin(S, sec > 0 ? (unsigned long)(sec * 1e9) : 0);
+    }
+    lua_pushnumber(L, (lua_Number)old / 1e9);
+    return 1;
+}
+
+static int Ltrampoline(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    int old = S->trampoline;
+    if (!lua_isnoneornil(L, 1))
+        lsc_settrampoline(S, lua_toboolean(L, 1));
+    lua_pushboolean(L, old);
+    return 1;
+}
+
+static int Lpool(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    if (!lua_isnoneornil(L, 1))
+        lsc_setpoollimit(L, (int)luaL_checkinteger(L, 1));
+    lua_pushinteger(L, S->npool);
+    lua_pushinteger(L, S->poollimit);
+    lua_pushinteger(L, (lua_Integer)S->poolhits);
+    lua_pushinteger(L, (lua_Integer)S->poolmisses);
+    return 4;
+}
+
+static int Lmetrics(lua_State *L) {
+    static const char *opts[] = { "table", "prometheus", NULL };
+    lsc_Metrics m;
+#ifdef LSC_USE_STATS
+    int i;
+#endif
+    lsc_metrics(lsc_state(L), &m);
+    if (luaL_checkoption(L, 1, "table", opts) == 1) {
+        lsc_pushprometheus(L, &m);
+        return 1;
+    }
+    lua_createtable(L, 0, 10);
+    lua_pushinteger(L, (lua_Integer)m.ticks);
+    lua_setfield(L, -2, "ticks");
+    lua_pushinteger(L, (lua_Integer)m.dispatched);
+    lua_setfield(L, -2, "dispatched");
+    lua_pushnumber(L, m.runtime);
+    lua_setfield(L, -2, "runtime");
+    lua_pushnumber(L, m.polltime);
+    lua_setfield(L, -2, "polltime");
+    lua_pushnumber(L, m.uptime);
+    lua_setfield(L, -2, "uptime");
+    lua_pushinteger(L, (lua_Integer)m.ready);
+    lua_setfield(L, -2, "ready");
+    lua_pushinteger(L, (lua_Integer)m.errors);
+    lua_setfield(L, -2, "errors");
+#ifdef LSC_USE_STATS
+    lua_pushnumber(L, m.latencysum);
+    lua_setfield(L, -2, "latencysum");
+    lua_createtable(L, LSC_LATENCY_BUCKETS, 0);
+    lua_createtable(L, LSC_LATENCY_BUCKETS, 0);
+    for (i = 0; i < LSC_LATENCY_BUCKETS; ++i) {
+        lua_pushinteger(L, (lua_Integer)m.latency[i]);
+        lua_rawseti(L, -3, i + 1);
+        lua_pushnumber(L, (lua_Number)lsc_latencybound(i) / 1e6);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -3, "latencybounds");
+    lua_setfield(L, -2, "latency");
+#endif
+    return 1;
+}
+
+#ifdef LSC_USE_STATS
+
+static int Lstats(lua_State *L) {
+    lsc_State *S = lsc_state(L);
+    int i, count = 0, n = (int)luaL_optinteger(L, 1, 10);
+    lsc_Task **top, *t = NULL;
+    luaL_argcheck(L, n > 0, 1, "top count must be positive");
+    top = (lsc_Task**)lua_newuserdata(L, n * sizeof(lsc_Task*));
+    while ((t = lsc_nexttask(S, t)) != NULL) {
+        /* keep the top n tasks by cpu, in descending order */
+        if (count == n && t->stats.cpu <= top[n-1]->stats.cpu)
+            continue;
+        for (i = count < n ? count++ : n - 1;
+                i > 0 && top[i-1]->stats.cpu < t->stats.cpu; --i)
+            top[i] = top[i-1];
+        top[i] = t;
+    }
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; ++i) {
+        aux_pushstats(L, top[i]);
+        if (lsc_pushtask(L, top[i]))
+            lua_setfield(L, -2, "task");
+        lua_rawseti(L, -2, i + 1);
+    }
     return 1;
 }
+#endif
 
 static int Lerrors(lua_State *L) {
     if (lua_gettop(L) == 0) {
@@ -1225,18 +5607,87 @@ static int Lcollect(lua_State *L) {
     return 1;
 }
 
+static int Ltrace_start(lua_State *L) {
+    lua_Integer size = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, size >= 0, 1, "invalid ring size");
+    lsc_tracestart(L, (size_t)size);
+    return 0;
+}
+
+static int Ltrace_stop(lua_State *L) {
+    const char *path = luaL_optstring(L, 1, NULL);
+    return luaL_fileresult(L, lsc_tracestop(L, path), path);
+}
+
+static int Lprofile_start(lua_State *L) {
+    int count = (int)luaL_optinteger(L, 1, 0);
+    lua_Integer samples = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, count >= 0, 1, "invalid instruction count");
+    luaL_argcheck(L, samples >= 0, 2, "invalid sample count");
+    lsc_profstart(L, count, (size_t)samples);
+    return 0;
+}
+
+static int Lprofile_stop(lua_State *L) {
+    const char *path = luaL_optstring(L, 1, NULL);
+    size_t len, dropped;
+    const char *s = lsc_profstop(L, &dropped);
+    if (path != NULL) {
+        FILE *fp = fopen(path, "w");
+        int ok = fp != NULL;
+        len = lua_rawlen(L, -1);
+        if (ok) ok = fwrite(s, 1, len, fp) == len;
+        if (fp != NULL) ok = fclose(fp) == 0 && ok;
+        if (!ok) return luaL_fileresult(L, 0, path);
+        lua_pushboolean(L, 1);
+        lua_replace(L, -2);
+    }
+    lua_pushinteger(L, (lua_Integer)dropped);
+    return 2;
+}
+
 LSCLUA_API int luaopen_sched(lua_State *L) {
+    luaL_Reg trace[] = {
+#define ENTRY(name) { #name, Ltrace_##name }
+        ENTRY(start),
+        ENTRY(stop),
+#undef  ENTRY
+        { NULL, NULL }
+    };
+    luaL_Reg profile[] = {
+#define ENTRY(name) { #name, Lprofile_##name }
+        ENTRY(start),
+        ENTRY(stop),
+#undef  ENTRY
+        { NULL, NULL }
+    };
     luaL_Reg libs[] = {
 #define ENTRY(name) { #name, L##name }
         ENTRY(setpoll),
         ENTRY(once),
         ENTRY(loop),
+        ENTRY(sleep),
+        ENTRY(select),
+        ENTRY(now),
+        ENTRY(nexttimeout),
+        ENTRY(spin),
+        ENTRY(trampoline),
+        ENTRY(pool),
+        ENTRY(quota),
         ENTRY(errors),
         ENTRY(collect),
+        ENTRY(metrics),
+#ifdef LSC_USE_STATS
+        ENTRY(stats),
+#endif
 #undef  ENTRY
         { NULL, NULL }
     };
     luaL_newlib(L, libs);
+    luaL_newlib(L, trace);
+    lua_setfield(L, -2, "trace");
+    luaL_newlib(L, profile);
+    lua_setfield(L, -2, "profile");
     return 1;
 }
 
@@ -1251,6 +5702,30 @@ LSC_API void lsc_install(lua_State *L) {
   lua_pushstring(L, "sched.task");
   lua_pushcfunction(L, luaopen_sched_task);
   lua_rawset(L, -3);
+  lua_pushstring(L, "sched.channel");
+  lua_pushcfunction(L, luaopen_sched_channel);
+  lua_rawset(L, -3);
+  lua_pushstring(L, "sched.sync");
+  lua_pushcfunction(L, luaopen_sched_sync);
+  lua_rawset(L, -3);
+  lua_pushstring(L, "sched.future");
+  lua_pushcfunction(L, luaopen_sched_future);
+  lua_rawset(L, -3);
+#ifdef LSC_USE_EPOLL
+  lua_pushstring(L, "sched.io");
+  lua_pushcfunction(L, luaopen_sched_io);
+  lua_rawset(L, -3);
+#endif
+#ifdef LSC_USE_CLUSTER
+  lua_pushstring(L, "sched.cluster");
+  lua_pushcfunction(L, luaopen_sched_cluster);
+  lua_rawset(L, -3);
+#endif
+#ifdef LSC_USE_OFFLOAD
+  lua_pushstring(L, "sched.offload");
+  lua_pushcfunction(L, luaopen_sched_offload);
+  lua_rawset(L, -3);
+#endif
   lua_pop(L, 1);
 }
 
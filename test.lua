@@ -106,6 +106,332 @@ add_test("signal_test", function()
    assert(counter == 10)
 end)
 
+add_test("broadcast_test", function()
+   local s, other = signal.new(), signal.new()
+   local args, got = {}, {}
+   for i = 1, 40 do args[i] = i end
+   for i = 1, 3 do -- fresh tasks get args as parameters
+      task.new(function(...) got[#got+1] = table.pack(...) end):wait(s)
+   end
+   task.new(function()
+      local t = table.pack(task.wait(s))
+      got[#got+1] = t
+   end)
+   task.new(function()
+      local t = table.pack(task.waitany(other, s))
+      assert(t[1] == 2)
+      got[#got+1] = table.pack(table.unpack(t, 2, t.n))
+   end)
+   sched.once()
+   assert(s:emit(table.unpack(args)))
+   assert(#got == 5)
+   for _, t in ipairs(got) do
+      assert(t.n == 40)
+      for i = 1, 40 do assert(t[i] == i) end
+   end
+   other:delete()
+end)
+
+add_test("move_test", function()
+   local s, s2, other = signal.new(), signal.new(), signal.new()
+   local got = {}
+   local ts = {}
+   for i = 1, 5 do
+      ts[i] = task.new(function(...) got[i] = { ... } end):wait(s)
+   end
+   ts[2]:priority(0)
+   ts[6] = task.new(function()
+      got[6] = { task.waitany(other, s) }
+   end)
+   assert(ts[6]:wakeup())
+   assert(s:count() == 6 and other:count() == 1)
+   assert(s:move(s2) == s)
+   assert(s:count() == 0 and s2:count() == 6 and other:count() == 0)
+   for i = 1, 6 do assert(s2:index(i) == ts[i]) end
+   s2:hold()
+   assert(s2:count() == 0 and ts[6]:status() == "hold")
+   for i = 1, 6 do ts[i]:wait(s) end
+   ts[6]:wait(s) -- already waitting, order kept
+   ts[7] = task.new(function()
+      got[7] = { task.waitany(other, s) }
+   end)
+   assert(ts[7]:wakeup())
+   assert(s:ready("a", "b") == s)
+   assert(s:count() == 0 and other:count() == 0)
+   for i = 1, 7 do assert(ts[i]:status() == "ready") end
+   sched.once()
+   for i = 1, 6 do assert(got[i][1] == "a" and got[i][2] == "b") end
+   assert(got[7][1] == 2 and got[7][2] == "a" and got[7][3] == "b")
+   s:delete(); s2:delete(); other:delete()
+end)
+
+add_test("trampoline_test", function()
+   local N = 1000 -- deeper than LUAI_MAXCCALLS
+   local function pipeline()
+      local ss, order = {}, {}
+      for i = 1, N do ss[i] = signal.new() end
+      for i = 1, N do
+         task.new(function()
+            local v = task.wait(ss[i])
+            order[#order+1] = i
+            if i < N then ss[i+1]:emit(v + 1) end
+            order[#order+1] = -i
+         end)
+      end
+      sched.once()
+      ss[1]:emit(1)
+      return order
+   end
+   assert(sched.trampoline() == false)
+   assert(#pipeline() < N*2) -- C stack overflow
+   sched.collect()
+   assert(sched.trampoline(true) == false)
+   local order = pipeline()
+   assert(#order == N*2)
+   for i = 1, N do
+      assert(order[i*2-1] == i and order[i*2] == -i)
+   end
+   -- a nested wakeup returns before the task runs
+   local s, ran = signal.new(), false
+   task.new(function() task.wait(s); ran = true end)
+   task.new(function()
+      assert(s:emit())
+      assert(not ran)
+   end)
+   sched.once()
+   assert(ran)
+   assert(sched.trampoline(false) == true)
+end)
+
+add_test("channel_test", function()
+   local channel = require "sched.channel"
+   local ch = channel.new(4)
+   assert(ch:trysend "a" and ch:trysend "b")
+   assert(select("#", ch:count()) == 2 and ch:count() == 2)
+   local ok, v = ch:tryrecv()
+   assert(ok and v == "a" and select(2, ch:tryrecv()) == "b")
+   assert(ch:tryrecv() == false)
+   local got, sent, batches = {}, 0, 0
+   local consumer = task.new(function()
+      while true do
+         local t = table.pack(ch:recvmany(3))
+         if t[1] == nil and t[2] == "closed" then break end
+         batches = batches + 1
+         for i = 1, t.n do got[#got+1] = t[i] end
+      end
+   end)
+   task.new(function()
+      for i = 1, 10 do assert(ch:send(i)); sent = i end
+   end)
+   sched.once()
+   -- buffer is full, producer blocks, consumer is ready
+   assert(sent == 4 and ch:trysend "x" == false)
+   assert(consumer:status() == "ready")
+   assert(sched.loop())
+   assert(sent == 10 and #got == 10 and batches < 10)
+   for i = 1, 10 do assert(got[i] == i) end
+   assert(consumer:status() == "waitting")
+   ch:close()
+   assert(sched.loop())
+   assert(consumer:status() == "finish")
+   assert(select(2, ch:send(1)) == "closed")
+   assert(select(2, ch:trysend(1)) == "closed")
+   assert(select(2, ch:tryrecv()) == "closed")
+   -- values left are still received after closed
+   ch = channel.new(2)
+   ch:trysend(nil); ch:close()
+   ok, v = ch:tryrecv()
+   assert(ok and v == nil)
+   ch = channel.new()
+   assert(not pcall(ch.recv, ch)) -- main task can not block
+end)
+
+add_test("select_test", function()
+   local channel = require "sched.channel"
+   local s, ch1, ch2 = signal.new(), channel.new(2), channel.new(2)
+   local res = {}
+   local t = task.new(function()
+      for i = 1, 4 do
+         res[i] = table.pack(sched.select { s, ch1, ch2 })
+      end
+   end)
+   assert(ch2:trysend "ready")
+   sched.once() -- channel ready already, no suspension
+   assert(res[1][1] == 3 and res[1][2] == "ready")
+   assert(t:status() == "waitting")
+   assert(s:count() == 1 and ch1:count() == 0)
+   assert(s:emit("a", "b"))
+   assert(res[2][1] == 1 and res[2][2] == "a" and res[2][3] == "b")
+   assert(ch1:trysend "one" and t:status() == "ready")
+   assert(s:count() == 0) -- other registrations cancelled
+   sched.once()
+   assert(res[3][1] == 2 and res[3][2] == "one")
+   ch2:close()
+   sched.once()
+   assert(res[4][1] == 3 and res[4][2] == nil and res[4][3] == "closed")
+   assert(t:status() == "finish")
+   assert(not pcall(sched.select, {}))
+   local ok, err = pcall(sched.select, { s, 1 })
+   assert(not ok and err:match "case 2")
+   -- numbers passed by wakeup are not taken as fired cases
+   t = task.new(function() res = table.pack(sched.select { s, ch1 }) end)
+   sched.once()
+   t:hold()
+   assert(t:wakeup(2, "x"))
+   assert(res.n == 3 and res[1] == nil and res[2] == 2 and res[3] == "x")
+end)
+
+add_test("sync_test", function()
+   local sync = require "sched.sync"
+   local m, order = sync.mutex(), {}
+   assert(m:lock() and not pcall(m.lock, m))
+   for i = 1, 3 do
+      task.new(function()
+         assert(m:lock())
+         order[#order+1] = i
+         sched.sleep(0)
+         m:unlock()
+      end)
+   end
+   sched.once()
+   m:unlock() -- handed to the first waiter
+   assert(not m:trylock() and not pcall(m.unlock, m))
+   assert(sched.loop())
+   assert(#order == 3 and order[1] == 1 and order[2] == 2 and order[3] == 3)
+   assert(m:trylock()); m:unlock()
+
+   local sem, n = sync.semaphore(2), 0
+   for i = 1, 4 do
+      task.new(function()
+         sem:acquire()
+         n = n + 1
+      end)
+   end
+   sched.once()
+   assert(n == 2 and sem:count() == 0 and not sem:tryacquire())
+   sem:release(3)
+   sched.once()
+   assert(n == 4 and sem:count() == 1)
+
+   local cv, items, got = sync.condvar(), {}, {}
+   for i = 1, 2 do
+      task.new(function()
+         m:lock()
+         while #items == 0 do assert(cv:wait(m)) end
+         got[#got+1] = table.remove(items, 1)
+         m:unlock()
+      end)
+   end
+   sched.once()
+   m:lock()
+   items[1], items[2] = "a", "b"
+   cv:broadcast()
+   m:unlock()
+   assert(sched.loop())
+   assert(got[1] == "a" and got[2] == "b")
+
+   local rw, log = sync.rwlock(), {}
+   assert(rw:rlock())
+   local w = task.new(function()
+      rw:wlock(); log[#log+1] = "w"; rw:wunlock()
+   end)
+   local r = task.new(function()
+      rw:rlock(); log[#log+1] = "r"; rw:runlock()
+   end)
+   sched.once()
+   -- writer waits for the reader, and the new reader waits for writer
+   assert(w:status() == "waitting" and r:status() == "waitting")
+   rw:runlock()
+   assert(sched.loop())
+   assert(log[1] == "w" and log[2] == "r")
+end)
+
+add_test("keyed_test", function()
+   local k, got = signal.keyed(), {}
+   for i = 1, 100 do
+      task.new(function()
+         got[i] = table.pack(k:wait(i % 50, "ctx"))
+      end)
+   end
+   sched.once()
+   assert(k:count(1) == 2 and k:count(50) == 0 and k:count "x" == 0)
+   assert(k:emit(1, "reply"))
+   assert(got[1][1] == "reply" and got[51][1] == "reply")
+   assert(got[2] == nil and k:count(1) == 0 and k:count(2) == 2)
+   assert(not k:emit(1) and not k:emit "x")
+   assert(k:emit(2)) -- no args, context returned
+   assert(got[2][1] == "ctx" and got[52][1] == "ctx")
+   assert(not pcall(k.wait, k, 1)) -- main task can not block
+   for i = 3, 49 do k:emit(i) end
+   assert(k:emit(0) and #got == 100)
+   assert(next(debug.getuservalue(k)) == nil)
+   -- keys are dropped however the waiters leave
+   local ts = {}
+   for i = 1, 100 do ts[i] = task.new(function() k:wait(i) end) end
+   sched.once()
+   assert(k:count(1) == 1 and k:count(100) == 1)
+   assert(ts[1]:wakeup() and ts[2]:ready())
+   ts[3]:hold()
+   assert(k:count(1) == 0 and k:count(2) == 0 and k:count(3) == 0)
+   assert(sched.loop() and ts[2]:status() == "finish")
+   assert(debug.getuservalue(k)[1] == nil and debug.getuservalue(k)[2] == nil)
+   for i = 3, 100 do ts[i]:delete() end
+   ts = nil
+   collectgarbage(); collectgarbage()
+   assert(next(debug.getuservalue(k)) == nil)
+end)
+
+add_test("future_test", function()
+   local future = require "sched.future"
+   local f, got = future.new(), {}
+   for i = 1, 2 do
+      task.new(function() got[i] = table.pack(f:await()) end)
+   end
+   local g = f:andthen(function(a, b) return a + b end)
+   local h = g:andthen(function(v) error("bad " .. v, 0) end)
+   local i = h:andthen(nil, function(err) return "caught " .. err end)
+   sched.once()
+   assert(f:status() == "pending" and not pcall(f.await, f))
+   assert(f:resolve(1, 2) and not f:resolve(3) and not f:reject "x")
+   assert(select("#", f:await()) == 2 and g:await() == 3)
+   assert(h:status() == "rejected" and i:await() == "caught bad 3")
+   assert(select(2, pcall(h.await, h)) == "bad 3")
+   assert(sched.loop())
+   assert(got[1].n == 2 and got[1][2] == 2 and got[2][1] == 1)
+   -- callback added to settled future runs at once
+   assert(f:andthen(function(a) return a * 10 end):await() == 10)
+   -- long chains settle without nesting C calls
+   local head = future.new()
+   local tail = head
+   for i = 1, 100000 do tail = tail:andthen() end
+   head:resolve "end"
+   assert(tail:await() == "end")
+
+   local fs = {}
+   for i = 1, 3 do fs[i] = future.new() end
+   local all, any = future.all(fs), future.any(fs)
+   fs[2]:reject "e2"
+   fs[3]:resolve("c", "d")
+   assert(all:status() == "rejected" and select(2, pcall(all.await, all)) == "e2")
+   local k, v1, v2 = any:await()
+   assert(k == 3 and v1 == "c" and v2 == "d")
+   for i = 1, 3 do fs[i] = future.new() end
+   all, any = future.all(fs), future.any(fs)
+   local waiter = task.new(function() got = all:await() end)
+   for i = 1, 3 do fs[i]:reject(i) end
+   assert(all:status() == "rejected" and any:status() == "rejected")
+   assert(select(2, pcall(any.await, any)) == 3)
+   for i = 1, 3 do fs[i] = future.new() end
+   all = future.all(fs)
+   task.new(function() got = all:await() end)
+   sched.once()
+   for i = 3, 1, -1 do fs[i]:resolve(i * 10) end
+   assert(sched.loop())
+   assert(#got == 3 and got[1] == 10 and got[3] == 30)
+   assert(#future.all{}:await() == 0)
+   assert(future.any{}:status() == "rejected")
+end)
+
 add_test("task_test", function()
    local t
    t = task.new(function()
@@ -137,6 +463,528 @@ add_test("task_test", function()
    assert(t:wakeup())
 end)
 
+add_test("timer_test", function()
+   local s1, s2 = signal.new(), signal.new()
+   local slept, timeout, fired
+   task.new(function()
+      sched.sleep(0.01)
+      slept = true
+   end)
+   task.new(function()
+      timeout = { task.waitfor(s1, 0.01, "ctx") }
+   end)
+   local t = task.new(function()
+      fired = task.waitfor(s2, 100)
+   end)
+   assert(sched.once())
+   assert(t:status() == "waitting")
+   assert(s1:index(1):context() == "ctx")
+   assert(s2:emit "fired")
+   assert(fired == "fired")
+   assert(sched.loop())
+   assert(slept)
+   assert(timeout[1] == nil and timeout[2] == "timeout")
+   assert(s1:count() == 0)
+   -- loop sleeps until the timer, instead of spinning
+   local start = os.clock()
+   task.new(function() sched.sleep(0.1) end)
+   assert(sched.loop())
+   assert(os.clock() - start < 0.05)
+end)
+
+add_test("waitany_test", function()
+   local s1, s2, s3 = signal.new(), signal.new(), signal.new()
+   local res
+   local t = task.new(function()
+      res = { task.waitany(s1, s2, s2, s3) }
+      res[4], res[5] = task.waitany(s1, s2)
+      return "ret"
+   end)
+   assert(t:wakeup())
+   assert(t:status() == "waitting")
+   assert(s1:count() == 1 and s2:count() == 1 and s3:count() == 1)
+   assert(s1:index(1) == t and s2:next(nil) == t)
+   assert(s3:emit("foo", "bar"))
+   assert(res[1] == 4 and res[2] == "foo" and res[3] == "bar")
+   assert(s2:count() == 1 and s3:count() == 0)
+   assert(t:wakeup "direct")
+   assert(res[4] == nil and res[5] == "direct")
+   assert(s1:count() == 0 and s2:count() == 0)
+   assert(t:status() == "dead")
+end)
+
+add_test("count_test", function()
+   local s, other = signal.new(), signal.new()
+   local ts = {}
+   for i = 1, 20 do
+      ts[i] = task.new(function() end):wait(s)
+   end
+   assert(s:count() == 20)
+   for i = 1, 20 do assert(s:index(i) == ts[i]) end
+   for i = 20, 1, -1 do assert(s:index(i) == ts[i]) end
+   assert(s:index(-1) == ts[20] and s:index(-20) == ts[1])
+   assert(s:index(21) == nil and s:index(-21) == nil)
+   ts[5]:wait(other)
+   ts[6]:hold()
+   assert(s:count() == 18 and other:count() == 1)
+   assert(s:index(5) == ts[7] and s:index(4) == ts[4])
+   -- cursor is dropped when another signal is indexed, or s changed
+   assert(other:index(1) == ts[5] and s:index(6) == ts[8])
+   ts[1]:hold()
+   assert(s:index(6) == ts[9] and s:index(1) == ts[2])
+   ts[1]:wait(s)
+   assert(s:index(17) == ts[20] and s:index(-1) == ts[1])
+   local t = task.new(function() task.waitany(s, other) end)
+   assert(t:wakeup())
+   assert(s:count() == 19 and other:count() == 2)
+   assert(s:index(-1) == t)
+   assert(other:emit())
+   assert(s:count() == 18 and other:count() == 0)
+   assert(s:emit())
+   assert(s:count() == 0 and s:index(1) == nil)
+   task.new(function() end):wait(s)
+   assert(s:count() == 1)
+   s:delete()
+   -- count is kept by the first node, check it against walking
+   local sigs = { signal.new(), signal.new(), signal.new() }
+   for i = 1, 30 do
+      task.new(function()
+         while true do
+            if i % 3 == 0 then task.waitany(sigs[1], sigs[2], sigs[3])
+            else task.wait(sigs[i % 3 + 1]) end
+         end
+      end)
+   end
+   for step = 1, 300 do
+      local a, b = sigs[step % 3 + 1], sigs[step % 2 + 1]
+      local ops = { a.emit, a.ready, a.hold, a.one, function() sched.once() end }
+      if step % 7 == 0 then a:move(b) else ops[step % 5 + 1](a) end
+      for _, q in ipairs(sigs) do
+         local n, t = 0, q:next()
+         while t do n = n + 1; assert(q:index(n) == t); t = q:next(t) end
+         assert(q:count() == n)
+      end
+   end
+end)
+
+add_test("current_test", function()
+   assert(task.status() == "running")
+   local ok, err = coroutine.wrap(function()
+      return pcall(task.status)
+   end)()
+   assert(not ok and err:match "not a task")
+   local s = signal.new()
+   local t = task.new(function()
+      local t = task.wait(s)
+      assert(task.status() == "running")
+      task.new(function() t:delete() end)
+   end)
+   assert(t:wakeup())
+   assert(s:index(1) == t)
+   assert(s:emit(t))
+   assert(sched.loop())
+   assert(t:status() == "dead" and s:index(1) == nil)
+end)
+
+add_test("pool_test", function()
+   local n, limit, hits, misses = sched.pool(2)
+   assert(limit == 2)
+   local co
+   local t = task.new(function(a)
+      co = coroutine.running()
+      return a
+   end, "a")
+   assert(sched.loop() and t:status() == "finish")
+   assert(t:context() == "a")
+   -- task.new never pools, escaped coroutine is never reused
+   local co2
+   t = task.new(function() co2 = coroutine.running() end)
+   assert(sched.loop() and t:status() == "finish" and co2 ~= co)
+   local n1, _, hits1, misses1 = sched.pool()
+   assert(n1 == n and hits1 == hits and misses1 == misses)
+   sched.pool(0)
+   assert(sched.pool() == 0)
+   sched.pool(64)
+end)
+
+add_test("lazy_test", function()
+   local s = signal.new()
+   local t1 = task.new(function(...) return select("#", ...), ... end,
+                       1, nil, 3)
+   local t2 = task.new(function(a) return a end)
+   assert(t1:status() == "ready" and t2:status() == "ready")
+   local ctx = { t1:context() }
+   assert(#ctx == 3 and ctx[1] == 1 and ctx[2] == nil and ctx[3] == 3)
+   assert(select("#", t2:context()) == 0)
+   t1:wait(s)
+   assert(s:index(1) == t1 and t1:status() == "waitting")
+   local joined
+   local jt = task.new(function(...) joined = { ... } end)
+   jt:join(t2)
+   t2:delete()
+   assert(t2:status() == "dead")
+   assert(sched.loop())
+   assert(joined[1] == true and type(joined[2]) == "function")
+   local res = { s:index(1):wakeup() }
+   assert(res[1] == true and res[2] == 3 and res[5] == 3)
+   -- finished task is not anchored by sched, but alive while referred
+   local t3 = task.new(function() return "done" end)
+   local weak = setmetatable({ task.new(function() return 1 end) }, { __mode = "v" })
+   assert(sched.loop())
+   collectgarbage(); collectgarbage()
+   assert(weak[1] == nil)
+   assert(t3:status() == "finish" and t3:context() == "done")
+   t3:delete()
+   assert(t3:status() == "dead")
+end)
+
+add_test("priority_test", function()
+   local order = {}
+   local function f(name) order[#order+1] = name end
+   local low = task.new(f, "low"):priority(3)
+   task.new(f, "normal")
+   local high = task.new(f, "high")
+   assert(high:priority() == 2)
+   assert(high:priority(0) == high and high:priority() == 0)
+   assert(high:status() == "ready" and low:status() == "ready")
+   assert(low:priority(100):priority() == 3)
+   sched.once()
+   assert(table.concat(order, " ") == "high normal low")
+   order = {}
+   assert(sched.quota(3, 2) == 0 and sched.quota(3) == 2)
+   for i = 1, 5 do task.new(f, i):priority(3) end
+   assert(sched.once())
+   assert(#order == 2)
+   task.new(f, "high"):priority(0)
+   assert(sched.once())
+   assert(table.concat(order, " ") == "1 2 high 3 4")
+   assert(not sched.once())
+   assert(#order == 6)
+   sched.quota(3, 0)
+end)
+
+add_test("budget_test", function()
+   local count = 0
+   for i = 1, 10 do
+      task.new(function() count = count + 1 end)
+   end
+   assert(sched.once { budget = 4 })
+   assert(count == 4)
+   task.new(function() count = count + 100 end):priority(0)
+   assert(sched.once { budget = 3 })
+   assert(count == 106)
+   assert(sched.loop { budget = 2 })
+   assert(count == 110)
+   for i = 1, 10 do
+      task.new(function() count = count + 1 end)
+   end
+   assert(sched.loop { time = 1 })
+   assert(count == 120)
+end)
+
+add_test("timeout_test", function()
+   assert(sched.nexttimeout() == nil)
+   local t = task.new(function() sched.sleep(0.2) end)
+   assert(sched.nexttimeout() == 0)
+   assert(sched.once())
+   local timeout = sched.nexttimeout()
+   assert(timeout > 0 and timeout <= 0.2)
+   t:delete()
+   assert(sched.spin(0.001) == 0 and sched.spin() == 0.001)
+   assert(sched.spin(0) == 0.001)
+end)
+
+add_test("stats_test", function()
+   if not sched.stats then return end
+   local function spin(n)
+      local x = 0
+      for i = 1, n do x = x + i end
+      return x
+   end
+   local never = signal.new()
+   local busy = task.new(function()
+      for i = 1, 3 do
+         spin(300000)
+         sched.sleep(0)
+      end
+      task.wait(never)
+   end)
+   local idle = task.new(function()
+      sched.sleep(0.05)
+      task.wait(never)
+   end)
+   assert(sched.loop())
+   local b, i = busy:stats(), idle:stats()
+   assert(b.resumes == 4 and i.resumes == 2)
+   assert(b.cpu > i.cpu and b.maxslice > 0 and b.maxslice <= b.cpu)
+   assert(i.wait >= 0.04)
+   local top = sched.stats(1)
+   assert(#top == 1 and top[1].task == busy and top[1].cpu == b.cpu)
+   assert(#sched.stats() >= 2)
+   busy:delete()
+   idle:delete()
+   for _, s in ipairs(sched.stats()) do assert(s.task ~= busy) end
+end)
+
+add_test("metrics_test", function()
+   local function total(m)
+      local n = 0
+      for _, c in ipairs(m.latency or {}) do n = n + c end
+      return n
+   end
+   local before = sched.metrics()
+   for i = 1, 10 do task.new(function() sched.sleep(0) end) end
+   assert(sched.metrics().ready == before.ready + 10)
+   assert(sched.loop())
+   local m = sched.metrics()
+   assert(m.ticks >= before.ticks + 2)
+   assert(m.dispatched == before.dispatched + 20)
+   assert(m.runtime > before.runtime and m.uptime >= before.uptime)
+   local text = sched.metrics "prometheus"
+   assert(text:match "\nlsched_ticks_total %d+\n")
+   if m.latency then -- the histogram needs LSC_USE_STATS
+      assert(total(m) == total(before) + 20)
+      assert(m.latencysum > before.latencysum)
+      assert(m.latencybounds[1] == 0 and m.latencybounds[5] == 4e-6)
+      assert(text:match('lsched_ready_latency_seconds_count ' .. total(m)))
+   end
+   assert(not pcall(sched.metrics, "json"))
+end)
+
+add_test("trace_test", function()
+   local path = os.tmpname()
+   local s = signal.new()
+   sched.trace.start()
+   task.new(function() task.wait(s) end)
+   task.new(function() s:emit() end)
+   assert(sched.loop())
+   assert(sched.trace.stop(path))
+   local f = assert(io.open(path))
+   local json = f:read "a"
+   f:close()
+   assert(json:match '^{"displayTimeUnit":"ns","traceEvents":%[')
+   for _, name in ipairs { "run", "wait", "ready", "emit" } do
+      assert(json:match('"name":"' .. name .. '"'))
+   end
+   assert(json:match '"ph":"B"' and json:match '"ph":"E"')
+   -- only the latest records are kept in ring
+   sched.trace.start(4)
+   for i = 1, 10 do task.new(function() end) end
+   assert(sched.loop())
+   assert(sched.trace.stop(path))
+   f = assert(io.open(path))
+   local n = 0
+   for line in f:lines() do
+      if line:match '"tid"' then n = n + 1 end
+   end
+   f:close()
+   os.remove(path)
+   assert(n == 4)
+   assert(sched.trace.stop()) -- nothing happens if not started
+   assert(not pcall(sched.trace.start, -1))
+end)
+
+add_test("profile_test", function()
+   local function inner(n)
+      local x = 0
+      for i = 1, n do x = x + i end
+      return x
+   end
+   local function busy()
+      for i = 1, 10 do
+         inner(10000)
+         sched.sleep(0)
+      end
+   end
+   sched.profile.start(100)
+   task.new(busy)
+   assert(sched.loop())
+   local folded, dropped = sched.profile.stop()
+   assert(dropped == 0)
+   local samples = 0
+   for line in folded:gmatch "[^\n]+" do
+      local stack, n = line:match "^(task%(.-%);.*) (%d+)$"
+      assert(stack, line)
+      if stack:match ";inner %(" then
+         assert(stack:match ";busy %([^;]*;inner %([^;]*$"
+             or stack:match ";%? %([^;]*;inner %([^;]*$", stack)
+         samples = samples + n
+      end
+   end
+   assert(samples > 100)
+   -- deep stacks keep the leaf frames
+   local function deep(n)
+      if n == 0 then return (inner(100000)) end
+      return (deep(n - 1))
+   end
+   sched.profile.start(100)
+   task.new(deep, 100)
+   assert(sched.loop())
+   folded = sched.profile.stop()
+   assert(folded:match ";deep %([^;\n]*;inner %([^;\n]* %d+\n")
+   -- samples are limited, and not taken after stopped
+   sched.profile.start(100, 2)
+   task.new(busy)
+   assert(sched.loop())
+   folded, dropped = sched.profile.stop()
+   assert(dropped > 0 and folded:match "%d+\n$")
+   task.new(busy)
+   assert(sched.loop())
+   assert(sched.profile.stop() == "")
+   -- coroutines created while profiling drop the inherited hook
+   local co
+   sched.profile.start(100)
+   task.new(function() co = coroutine.create(inner) end)
+   assert(sched.loop())
+   sched.profile.stop()
+   assert(debug.gethook(co) ~= nil)
+   assert(coroutine.resume(co, 100000))
+   assert(debug.gethook(co) == nil)
+end)
+
+add_test("io_test", function()
+   local ok, sio = pcall(require, "sched.io")
+   if not ok then return end -- no epoll backend
+   local path = os.tmpname()
+   os.remove(path)
+   assert(os.execute("mkfifo " .. path))
+   local r = assert(io.open(path, "r+"))
+   local w = assert(io.open(path, "w"))
+   local fd, got, res = sio.fileno(r)
+   local t = task.new(function()
+      assert(sio.wait(fd, "r", "ctx") == true)
+      got = r:read(5)
+      res = { sio.wait(fd, "r") }
+   end)
+   assert(sched.once())
+   assert(t:status() == "waitting" and t:context() == "ctx")
+   w:write "hello"
+   w:flush()
+   assert(sched.once()) -- fd readable, task is ready
+   assert(t:status() == "ready")
+   task.new(function()
+      assert(got == "hello" and t:status() == "waitting")
+      -- writable event arrived before, no wait
+      assert(sio.wait(fd, "w") == true)
+      assert(sio.close(fd) and not sio.close(fd))
+   end)
+   assert(sched.loop())
+   assert(res[1] == nil and res[2] == "closed")
+   assert(t:status() == "finish")
+   r:close()
+   w:close()
+   os.remove(path)
+end)
+
+add_test("cluster_test", function()
+   local ok, cluster = pcall(require, "sched.cluster")
+   if not ok then return end -- no cluster support
+   cluster.start(2, [[
+      local cluster = require "sched.cluster"
+      local task = require "sched.task"
+      local id, n, tag = ...
+      task.new(function()
+         while true do
+            local from, v = cluster.recv()
+            if from == nil then break end -- closed
+            cluster.send(from, id, n, tag, v)
+         end
+      end)
+   ]], "tag")
+   assert(cluster.id() == 0)
+   local replies = {}
+   task.new(function()
+      cluster.send(1, { a = 1, [2] = { true } })
+      cluster.send(2, 1.5)
+      for i = 1, 2 do
+         local from, id, n, tag, v = cluster.recv()
+         assert(from == id and n == 2 and tag == "tag")
+         replies[id] = v
+      end
+   end)
+   assert(sched.loop())
+   assert(replies[1].a == 1 and replies[1][2][1] == true)
+   assert(replies[2] == 1.5)
+   assert(not pcall(cluster.send, 1, print))
+   assert(not pcall(cluster.send, 3))
+   assert(cluster.join())
+   assert(cluster.id() == nil)
+   cluster.start(1, "error 'boom'")
+   local ok, err = cluster.join()
+   assert(not ok and err:match "worker 1: .*boom")
+end)
+
+add_test("offload_test", function()
+   local ok, offload = pcall(require, "sched.offload")
+   if not ok then return end
+   local path = os.tmpname()
+   local ticks, res = 0, {}
+   task.new(function()
+      assert(offload.writefile(path, "hello\0world"))
+      res.read = offload.readfile(path)
+      res.missing = select(2, offload.readfile(path .. ".missing"))
+      res.exit = select(3, offload.execute "exit 3")
+      res.addrs = offload.resolve "localhost" or {}
+      local start = ticks
+      assert(offload.execute "sleep 0.2")
+      res.ticks = ticks - start
+   end)
+   task.new(function()
+      while not res.ticks do
+         ticks = ticks + 1
+         sched.sleep(0.01)
+      end
+   end)
+   assert(sched.loop())
+   os.remove(path)
+   assert(res.read == "hello\0world")
+   assert(res.missing:match "%.missing")
+   assert(res.exit == select(3, os.execute "exit 3"))
+   for _, addr in ipairs(res.addrs) do assert(type(addr) == "string") end
+   -- the scheduler keeps running while the command blocks
+   assert(res.ticks > 5)
+   assert(not pcall(offload.readfile, path))
+end)
+
+add_test("poll_test", function()
+   -- keep it last, the poll function can not be removed
+   local n = 0
+   sched.setpoll(function() n = n + 1; return n < 3 end)
+   assert(sched.loop() and n == 3)
+   -- false ends the loop only when nothing is pending
+   sched.setpoll(function() return false end)
+   assert(sched.once() == false)
+   local done
+   task.new(function() sched.sleep(0.001); done = true end)
+   assert(sched.loop() and done)
+   sched.setpoll(function() return true end)
+   assert(sched.once() == true)
+   local ok, sio = pcall(require, "sched.io")
+   if not ok then return end -- no epoll backend
+   local path = os.tmpname()
+   os.remove(path)
+   assert(os.execute("mkfifo " .. path))
+   local r = assert(io.open(path, "r+"))
+   local w = assert(io.open(path, "w"))
+   local fd, got = sio.fileno(r)
+   task.new(function()
+      assert(sio.wait(fd, "r") == true)
+      got = r:read(5)
+      sio.close(fd)
+   end)
+   -- I/O backend is still polled, and the fd keeps loop running
+   n = 0
+   sched.setpoll(function()
+      n = n + 1
+      if n == 1 then w:write "hello"; w:flush() end
+      return false
+   end)
+   assert(sched.loop() and got == "hello" and n == 2)
+   r:close()
+   w:close()
+   os.remove(path)
+end)
+
 if arg[1] then
    if tests[arg[1]] then
       print(arg[1])